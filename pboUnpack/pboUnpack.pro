@@ -55,7 +55,7 @@ win32-msvc* {
 #          PROJECT FILES
 #====================================================================
 
-# Dependencies: GLUT (freeglut3-dev)
+# Dependencies: GLUT (freeglut3-dev), threads, EGL and Xlib (libegl-dev, libx11-dev)
 
 INCLUDEPATH += \
     src
@@ -63,15 +63,27 @@ INCLUDEPATH += \
 DEPENDPATH += \
     src
 
-LIBS += -lglut -lGLU -lGL -lm
+LIBS += -lglut -lGLU -lGL -lm -lpthread -lEGL -lX11
 
 HEADERS += \
     src/glInfo.h \
-    src/Timer.h
+    src/HostMemory.h \
+    src/LatencyHistogram.h \
+    src/PixelFill.h \
+    src/SharedContext.h \
+    src/SpscQueue.h \
+    src/StagingPool.h \
+    src/Timer.h \
+    src/WorkerPool.h
 
 SOURCES += src/main.cpp \
     src/glInfo.cpp \
-    src/Timer.cpp
+    src/HostMemory.cpp \
+    src/PixelFill.cpp \
+    src/SharedContext.cpp \
+    src/StagingPool.cpp \
+    src/Timer.cpp \
+    src/WorkerPool.cpp
 
 #FORMS += MyForm.ui
 #RESOURCES += resources.qrc
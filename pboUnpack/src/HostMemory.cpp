@@ -0,0 +1,435 @@
+///////////////////////////////////////////////////////////////////////////////
+// HostMemory.cpp
+// ==============
+// System memory for the staging buffers backed by huge pages, its placement
+// on the NUMA nodes, faulting it in and locking it ahead of use, and counters
+// of the dTLB misses and page faults.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "HostMemory.h"
+#include <map>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/resource.h>   // getrusage
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <unistd.h>
+#include <sched.h>          // sched_setaffinity
+#include <cstring>
+#endif
+
+#if defined(__linux__)
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+// From <numaif.h>, which is part of libnuma rather than of the C library
+#define NUMA_MPOL_PREFERRED 1
+#define NUMA_MPOL_BIND      2
+#define NUMA_MPOL_MF_MOVE   (1 << 1)
+#endif
+
+namespace
+{
+const size_t HUGE_PAGE_2MB = 2 * 1024 * 1024;
+const size_t HUGE_PAGE_1GB = 1024 * 1024 * 1024;
+
+std::mutex mappingMutex;
+std::map<void*, size_t> mappings;               // address and size of each mapping
+std::map<void*, size_t> lockedRanges;           // address and size of each lockPages()
+
+#if defined(__linux__)
+const int MAX_NUMA_NODES = 1024;                // bits of the node masks
+const int NODE_MASK_WORDS = MAX_NUMA_NODES / (8 * sizeof(unsigned long));
+const int TLB_COUNTER_COUNT = 2;                // load misses, store misses
+int tlbCounters[TLB_COUNTER_COUNT] = { -1, -1 };
+
+size_t roundUp(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// mapping of reserved huge pages, NULL if none are available
+///////////////////////////////////////////////////////////////////////////////
+void* mapReserved(size_t size, int sizeFlag)
+{
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | sizeFlag, -1, 0);
+    return (ptr == MAP_FAILED) ? NULL : ptr;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// 2 MB aligned mapping of normal pages, that the kernel may back with
+// transparent huge pages
+// A larger area is mapped, then trimmed to the aligned part.
+///////////////////////////////////////////////////////////////////////////////
+void* mapTransparent(size_t size)
+{
+    size_t mappedSize = size + HUGE_PAGE_2MB;
+    void* mapped = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED)
+        return NULL;
+
+    char* begin = (char*)mapped;
+    char* ptr = (char*)roundUp((size_t)begin, HUGE_PAGE_2MB);
+    if (ptr > begin)
+        munmap(begin, ptr - begin);
+    if (ptr + size < begin + mappedSize)
+        munmap(ptr + size, begin + mappedSize - (ptr + size));
+
+    if (madvise(ptr, size, MADV_HUGEPAGE) != 0) {
+        munmap(ptr, size); // The kernel has no transparent huge pages
+        return NULL;
+    }
+    return ptr;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// append the numbers of a sysfs list like "0-3,8,10-11" to 'values'
+///////////////////////////////////////////////////////////////////////////////
+bool readSysfsList(const char* path, std::vector<int>& values)
+{
+    std::ifstream file(path);
+    std::string text;
+    if (!file || !std::getline(file, text))
+        return false;
+
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        int first = 0, last = 0;
+        char dash = 0;
+        std::stringstream range(item);
+        if (!(range >> first))
+            continue;
+        if (!(range >> dash >> last))
+            last = first;
+        for (int i = first; i <= last; ++i)
+            values.push_back(i);
+    }
+    return true;
+}
+
+void setNodeMask(unsigned long* mask, int node)
+{
+    memset(mask, 0, NODE_MASK_WORDS * sizeof(unsigned long));
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// counter of dTLB misses of the calling thread and of the threads it creates
+// from now on, -1 if not permitted
+// Kernel misses (e.g. the driver copying the buffer) are counted if allowed.
+///////////////////////////////////////////////////////////////////////////////
+int openTlbCounter(unsigned long long op)
+{
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (op << 8) | ((unsigned long long)PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_hv = 1;
+    attr.inherit = 1;    // read() sums the counts of the threads created later
+
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0) {
+        attr.exclude_kernel = 1; // Only the user space is allowed
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    return fd;
+}
+#endif
+}
+
+
+
+const char* getHugePagesName(HugePages mode)
+{
+    switch (mode) {
+    case HUGE_PAGES_OFF:
+        return "System pages";
+    case HUGE_PAGES_TRANSPARENT:
+        return "Transparent huge pages";
+    case HUGE_PAGES_2MB:
+        return "2 MB huge pages";
+    case HUGE_PAGES_1GB:
+        return "1 GB huge pages";
+    default:
+        return "";
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// map 'size' bytes with the largest huge pages available up to 'mode'
+///////////////////////////////////////////////////////////////////////////////
+void* allocHugePages(size_t size, HugePages mode, HugePages* usedMode)
+{
+    void* ptr = NULL;
+    size_t mappedSize = 0;
+#if defined(__linux__)
+    for (int i = mode; i > HUGE_PAGES_OFF && !ptr; --i) {
+        if (i == HUGE_PAGES_1GB) {
+            mappedSize = roundUp(size, HUGE_PAGE_1GB);
+            ptr = mapReserved(mappedSize, MAP_HUGE_1GB);
+        }
+        else if (i == HUGE_PAGES_2MB) {
+            mappedSize = roundUp(size, HUGE_PAGE_2MB);
+            ptr = mapReserved(mappedSize, MAP_HUGE_2MB);
+        }
+        else {
+            mappedSize = roundUp(size, HUGE_PAGE_2MB);
+            ptr = mapTransparent(mappedSize);
+        }
+        if (ptr && usedMode)
+            *usedMode = (HugePages)i;
+    }
+#endif
+    if (!ptr)
+        return NULL;
+
+    std::lock_guard<std::mutex> lock(mappingMutex);
+    mappings[ptr] = mappedSize;
+    return ptr;
+}
+
+
+
+bool freeHugePages(void* ptr)
+{
+    size_t size = 0;
+    {
+        std::lock_guard<std::mutex> lock(mappingMutex);
+        std::map<void*, size_t>::iterator it = mappings.find(ptr);
+        if (it == mappings.end())
+            return false;
+        size = it->second;
+        mappings.erase(it);
+    }
+#if defined(__linux__)
+    munmap(ptr, size);
+#endif
+    return true;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// write to each page, volatile so that the stores are not merged or dropped
+///////////////////////////////////////////////////////////////////////////////
+void touchPages(void* ptr, size_t size)
+{
+#if defined(__linux__)
+    size_t pageSize = (size_t)sysconf(_SC_PAGE_SIZE);
+#else
+    size_t pageSize = 4096;
+#endif
+    volatile char* bytes = (volatile char*)ptr;
+    for (size_t i = 0; i < size; i += pageSize)
+        bytes[i] = 0;
+    if (size > 0)
+        bytes[size - 1] = 0; // The last page, if 'ptr' is not page aligned
+}
+
+
+
+bool lockPages(void* ptr, size_t size)
+{
+#if defined(__linux__)
+    if (mlock(ptr, size) != 0)
+        return false;
+
+    std::lock_guard<std::mutex> lock(mappingMutex);
+    lockedRanges[ptr] = size;
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+
+void unlockPages(void* ptr)
+{
+    size_t size = 0;
+    {
+        std::lock_guard<std::mutex> lock(mappingMutex);
+        std::map<void*, size_t>::iterator it = lockedRanges.find(ptr);
+        if (it == lockedRanges.end())
+            return;
+        size = it->second;
+        lockedRanges.erase(it);
+    }
+#if defined(__linux__)
+    munlock(ptr, size);
+#endif
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// highest online node + 1, from sysfs
+///////////////////////////////////////////////////////////////////////////////
+int getNumaNodeCount()
+{
+#if defined(__linux__)
+    std::vector<int> nodes;
+    if (readSysfsList("/sys/devices/system/node/online", nodes) && !nodes.empty()) {
+        int count = nodes.back() + 1;
+        return (count < MAX_NUMA_NODES) ? count : MAX_NUMA_NODES;
+    }
+#endif
+    return 1;
+}
+
+
+
+bool setNumaNode(int node)
+{
+#if defined(__linux__)
+    if (node < 0 || node >= getNumaNodeCount())
+        return false;
+
+    // Preferred rather than bound, the driver allocates through this thread too
+    unsigned long mask[NODE_MASK_WORDS];
+    setNodeMask(mask, node);
+    bool result = syscall(SYS_set_mempolicy, NUMA_MPOL_PREFERRED, mask, MAX_NUMA_NODES + 1) == 0;
+
+    std::vector<int> cpus;
+    std::stringstream path;
+    path << "/sys/devices/system/node/node" << node << "/cpulist";
+    if (readSysfsList(path.str().c_str(), cpus) && !cpus.empty()) {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        for (size_t i = 0; i < cpus.size(); ++i) {
+            if (cpus[i] < CPU_SETSIZE)
+                CPU_SET(cpus[i], &cpuSet);
+        }
+        result = (sched_setaffinity(0, sizeof(cpuSet), &cpuSet) == 0) && result;
+    }
+    else {
+        result = false; // A node without CPUs, e.g. memory only
+    }
+    return result;
+#else
+    return false;
+#endif
+}
+
+
+
+bool bindNumaNode(void* ptr, size_t size, int node)
+{
+#if defined(__linux__)
+    if (node < 0 || node >= getNumaNodeCount())
+        return false;
+
+    // mbind() needs a page aligned start
+    size_t pageSize = (size_t)sysconf(_SC_PAGE_SIZE);
+    size_t begin = (size_t)ptr / pageSize * pageSize;
+    unsigned long mask[NODE_MASK_WORDS];
+    setNodeMask(mask, node);
+    return syscall(SYS_mbind, begin, (size_t)ptr + size - begin, NUMA_MPOL_BIND, mask,
+                   MAX_NUMA_NODES + 1, NUMA_MPOL_MF_MOVE) == 0;
+#else
+    return false;
+#endif
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ask move_pages() where the pages are, without moving them
+///////////////////////////////////////////////////////////////////////////////
+bool getPageNodes(const void* ptr, size_t size, int maxPages, std::vector<int>& pageCounts)
+{
+    int nodeCount = getNumaNodeCount();
+    pageCounts.assign(nodeCount + 1, 0);
+#if defined(__linux__)
+    size_t pageSize = (size_t)sysconf(_SC_PAGE_SIZE);
+    size_t begin = (size_t)ptr / pageSize * pageSize;
+    size_t pageCount = ((size_t)ptr + size - begin + pageSize - 1) / pageSize;
+    size_t sampleCount = (pageCount < (size_t)maxPages) ? pageCount : (size_t)maxPages;
+    if (sampleCount == 0)
+        return true;
+
+    std::vector<void*> pages(sampleCount);
+    std::vector<int> status(sampleCount);
+    for (size_t i = 0; i < sampleCount; ++i)
+        pages[i] = (void*)(begin + i * pageCount / sampleCount * pageSize);
+    if (syscall(SYS_move_pages, 0, sampleCount, &pages[0], NULL, &status[0], 0) != 0)
+        return false;
+
+    for (size_t i = 0; i < sampleCount; ++i) {
+        if (status[i] >= 0 && status[i] < nodeCount)
+            ++pageCounts[status[i]];
+        else
+            ++pageCounts[nodeCount]; // -ENOENT: not faulted in yet
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// start counting the dTLB misses of the calling thread and of its new threads
+///////////////////////////////////////////////////////////////////////////////
+bool openMemoryCounters()
+{
+    closeMemoryCounters();
+#if defined(__linux__)
+    tlbCounters[0] = openTlbCounter(PERF_COUNT_HW_CACHE_OP_READ);
+    tlbCounters[1] = openTlbCounter(PERF_COUNT_HW_CACHE_OP_WRITE); // Not counted by some CPUs
+    return tlbCounters[0] >= 0 || tlbCounters[1] >= 0;
+#else
+    return false;
+#endif
+}
+
+void closeMemoryCounters()
+{
+#if defined(__linux__)
+    for (int i = 0; i < TLB_COUNTER_COUNT; ++i) {
+        if (tlbCounters[i] >= 0)
+            close(tlbCounters[i]);
+        tlbCounters[i] = -1;
+    }
+#endif
+}
+
+void readMemoryCounters(MemoryCounters& counters)
+{
+    counters.dtlbMisses = counters.minorFaults = counters.majorFaults = -1;
+#if defined(__linux__)
+    for (int i = 0; i < TLB_COUNTER_COUNT; ++i) {
+        long long value = 0;
+        if (tlbCounters[i] >= 0 && read(tlbCounters[i], &value, sizeof(value)) == sizeof(value)) {
+            if (counters.dtlbMisses < 0)
+                counters.dtlbMisses = 0;
+            counters.dtlbMisses += value;
+        }
+    }
+
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        counters.minorFaults = usage.ru_minflt;
+        counters.majorFaults = usage.ru_majflt;
+    }
+#endif
+}
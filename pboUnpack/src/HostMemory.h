@@ -0,0 +1,87 @@
+///////////////////////////////////////////////////////////////////////////////
+// HostMemory.h
+// ============
+// System memory for the staging buffers backed by huge pages, its placement
+// on the NUMA nodes, faulting it in and locking it ahead of use, and counters
+// of the dTLB misses and page faults.
+// A 64 MB frame spans 16384 pages of 4 KB but only 32 pages of 2 MB, so
+// writing it misses the TLB far less often, and the driver has far fewer
+// pages to pin or translate.
+//
+// Huge pages need Linux. The reserved pages (MAP_HUGETLB) must have been set
+// aside by the administrator, e.g. /proc/sys/vm/nr_hugepages. Transparent
+// huge pages (madvise) only need /sys/kernel/mm/transparent_hugepage/enabled
+// to be "always" or "madvise", but the kernel gives them on a best effort
+// basis. When a mode is not available, the next smaller one is tried.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef HOST_MEMORY_H_DEF
+#define HOST_MEMORY_H_DEF
+
+#include <cstddef>
+#include <vector>
+
+enum HugePages
+{
+    HUGE_PAGES_OFF = 0,                         // pages of the system size, not allocated here
+    HUGE_PAGES_TRANSPARENT,                     // 2 MB aligned mapping advised to use huge pages
+    HUGE_PAGES_2MB,                             // reserved 2 MB pages
+    HUGE_PAGES_1GB,                             // reserved 1 GB pages
+    HUGE_PAGES_COUNT
+};
+
+const char* getHugePagesName(HugePages mode);
+
+// zero filled memory of at least 'size' bytes, aligned to 2 MB
+// Falls back to the smaller huge pages, then returns NULL if no mode down to
+// HUGE_PAGES_TRANSPARENT worked. 'usedMode' receives the mode that worked.
+void* allocHugePages(size_t size, HugePages mode, HugePages* usedMode);
+
+// unmap memory from allocHugePages(), false if 'ptr' does not come from it
+bool freeHugePages(void* ptr);
+
+// A fresh buffer gets its memory one page at a time, each page faulting
+// the first time it is written, so the first frames written to it stall.
+// write a zero byte in each page of [ptr, ptr + size), to fault them all in
+void touchPages(void* ptr, size_t size);
+
+// keep the pages of [ptr, ptr + size) in RAM (mlock), false if not permitted,
+// e.g. over RLIMIT_MEMLOCK; they are unlocked by unlockPages(ptr)
+bool lockPages(void* ptr, size_t size);
+void unlockPages(void* ptr);                    // nothing if 'ptr' was not locked
+
+// NUMA placement (Linux only)
+// A buffer on another node than the CPU writing it and the PCIe slot of the
+// GPU crosses the link between the sockets twice. Without NUMA support, the
+// system is seen as a single node 0 and nothing is bound.
+int getNumaNodeCount();                         // 1 without NUMA support
+
+// prefer the memory of 'node' for the allocations of the calling thread, and
+// run it on the CPUs of 'node'; the threads it creates afterwards inherit both
+bool setNumaNode(int node);
+
+// bind the pages of [ptr, ptr + size) to 'node', moving the ones already there
+bool bindNumaNode(void* ptr, size_t size, int node);
+
+// amount of pages of [ptr, ptr + size) on each node, sampling at most
+// 'maxPages' pages; the last element counts the pages not faulted in yet
+bool getPageNodes(const void* ptr, size_t size, int maxPages, std::vector<int>& pageCounts);
+
+// Running counts of the dTLB misses of the thread that called
+// openMemoryCounters() and of all the threads it starts afterwards (fill,
+// producer, upload worker and driver threads), and of the page faults of the
+// whole process.
+// The dTLB counts need perf events, which may be forbidden by
+// /proc/sys/kernel/perf_event_paranoid. The counts not available are -1.
+struct MemoryCounters
+{
+    long long dtlbMisses;                       // dTLB load and store misses
+    long long minorFaults;                      // page faults without any I/O
+    long long majorFaults;                      // page faults with I/O
+};
+
+bool openMemoryCounters();                      // false if the dTLB cannot be counted
+void closeMemoryCounters();
+void readMemoryCounters(MemoryCounters& counters);
+
+#endif // HOST_MEMORY_H_DEF
@@ -0,0 +1,80 @@
+///////////////////////////////////////////////////////////////////////////////
+// LatencyHistogram.h
+// ==================
+// Histogram of durations in milliseconds with logarithmic buckets, to get the
+// percentiles of per-frame timings without storing every sample.
+// Each power of 2 is split into 16 buckets, so a percentile is within 4.4% of
+// the exact value, from 1 us up to several minutes. Percentiles return the
+// upper bound of their bucket, never more than the largest sample.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef LATENCY_HISTOGRAM_H_DEF
+#define LATENCY_HISTOGRAM_H_DEF
+
+#include <cmath>
+#include <vector>
+
+
+class LatencyHistogram
+{
+public:
+    LatencyHistogram()
+        : buckets(BUCKET_COUNT, 0), count(0), sum(0), maxValue(0) {}
+
+    void add(double ms)                         // add one sample
+    {
+        int idx = 0;
+        if (ms > MIN_VALUE()) {
+            idx = (int)(std::log(ms / MIN_VALUE()) / std::log(2.0) * SUB_BUCKET_COUNT) + 1;
+            if (idx >= BUCKET_COUNT)
+                idx = BUCKET_COUNT - 1;
+        }
+        ++buckets[idx];
+        ++count;
+        sum += ms;
+        if (ms > maxValue)
+            maxValue = ms;
+    }
+
+    void clear()                                // remove all samples
+    {
+        buckets.assign(BUCKET_COUNT, 0);
+        count = 0;
+        sum = maxValue = 0;
+    }
+
+    long long getCount() const                  { return count; }
+    double getMax() const                       { return maxValue; }
+    double getMean() const                      { return (count > 0) ? sum / count : 0; }
+
+    double getPercentile(double percent) const  // e.g. 99.9 for p99.9, 0 if empty
+    {
+        if (count == 0)
+            return 0;
+
+        long long rank = (long long)std::ceil(percent / 100.0 * count);
+        if (rank < 1)
+            rank = 1;
+        long long total = 0;
+        for (int i = 0; i < BUCKET_COUNT; ++i) {
+            total += buckets[i];
+            if (total >= rank) {
+                double upper = MIN_VALUE() * std::pow(2.0, (double)i / SUB_BUCKET_COUNT);
+                return (upper < maxValue) ? upper : maxValue;
+            }
+        }
+        return maxValue;
+    }
+
+private:
+    static const int SUB_BUCKET_COUNT = 16;     // buckets per power of 2
+    static const int BUCKET_COUNT = SUB_BUCKET_COUNT * 28 + 1; // up to 2^28 us (4.5 min)
+    static double MIN_VALUE()                   { return 0.001; } // 1 us, upper bound of bucket 0
+
+    std::vector<long long> buckets;
+    long long count;
+    double sum;
+    double maxValue;
+};
+
+#endif // LATENCY_HISTOGRAM_H_DEF
@@ -0,0 +1,252 @@
+///////////////////////////////////////////////////////////////////////////////
+// PixelFill.cpp
+// =============
+// Kernels writing a run of identical pixels, used to generate the frames.
+//
+// The vector kernels repeat a pattern of PATTERN_SIZE bytes, the smallest
+// multiple of all pixel sizes (1, 2, 3, 4, 8) and of the vector sizes (16,
+// 32). They stream whole cache lines only: the head of the run up to the
+// first cache line boundary and the tail after the last one are written with
+// memcpy().
+///////////////////////////////////////////////////////////////////////////////
+
+#include "PixelFill.h"
+#include <cstring>
+#include <cstddef>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PIXEL_FILL_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h> // __cpuid
+#endif
+#endif
+
+// GCC and Clang compile the intrinsics of a function only if it targets them
+#if defined(PIXEL_FILL_X86) && defined(__GNUC__)
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_AVX2
+#endif
+
+namespace
+{
+const int PATTERN_SIZE = 96;
+const size_t CACHE_LINE_SIZE = 64;      // also aligns the vectors of SSE2 and AVX2
+
+///////////////////////////////////////////////////////////////////////////////
+// one pixel at a time
+///////////////////////////////////////////////////////////////////////////////
+void fillScalar(unsigned char* dst, const void* pixel, int bytesPerPixel, int count)
+{
+    switch (bytesPerPixel) {
+    case 4: // copy 4 bytes at once
+    {
+        int value;
+        memcpy(&value, pixel, 4);
+        int* ptr = (int*)dst;
+        for (int i = 0; i < count; ++i)
+            *ptr++ = value;
+        break;
+    }
+    case 8:
+    {
+        long long value;
+        memcpy(&value, pixel, 8);
+        long long* ptr = (long long*)dst;
+        for (int i = 0; i < count; ++i)
+            *ptr++ = value;
+        break;
+    }
+    case 2:
+    {
+        short value;
+        memcpy(&value, pixel, 2);
+        short* ptr = (short*)dst;
+        for (int i = 0; i < count; ++i)
+            *ptr++ = value;
+        break;
+    }
+    case 1:
+        memset(dst, *(const unsigned char*)pixel, count);
+        break;
+    default:
+        for (int i = 0; i < count; ++i)
+            memcpy(dst + (size_t)i * bytesPerPixel, pixel, bytesPerPixel);
+        break;
+    }
+}
+
+#if defined(PIXEL_FILL_X86)
+///////////////////////////////////////////////////////////////////////////////
+// write 'lineCount' cache lines of the 96 bytes pattern repeated from
+// 'pattern' to 'dst' (64-byte aligned)
+// Whole patterns are written first, then the vectors left to fill the last
+// line, since a pattern is one and a half line long.
+///////////////////////////////////////////////////////////////////////////////
+TARGET_SSE2 void streamSse2(unsigned char* dst, const unsigned char* pattern, size_t lineCount)
+{
+    __m128i v[6];
+    for (int i = 0; i < 6; ++i)
+        v[i] = _mm_loadu_si128((const __m128i*)(pattern + 16 * i));
+
+    size_t vectorCount = lineCount * (CACHE_LINE_SIZE / 16);
+    for (size_t i = 0; i < vectorCount / 6; ++i, dst += PATTERN_SIZE) {
+        _mm_stream_si128((__m128i*)(dst), v[0]);
+        _mm_stream_si128((__m128i*)(dst + 16), v[1]);
+        _mm_stream_si128((__m128i*)(dst + 32), v[2]);
+        _mm_stream_si128((__m128i*)(dst + 48), v[3]);
+        _mm_stream_si128((__m128i*)(dst + 64), v[4]);
+        _mm_stream_si128((__m128i*)(dst + 80), v[5]);
+    }
+    for (size_t i = 0; i < vectorCount % 6; ++i)
+        _mm_stream_si128((__m128i*)(dst + 16 * i), v[i]);
+    _mm_sfence();
+}
+
+TARGET_AVX2 void streamAvx2(unsigned char* dst, const unsigned char* pattern, size_t lineCount)
+{
+    __m256i v0 = _mm256_loadu_si256((const __m256i*)(pattern));
+    __m256i v1 = _mm256_loadu_si256((const __m256i*)(pattern + 32));
+    __m256i v2 = _mm256_loadu_si256((const __m256i*)(pattern + 64));
+
+    size_t vectorCount = lineCount * (CACHE_LINE_SIZE / 32);
+    for (size_t i = 0; i < vectorCount / 3; ++i, dst += PATTERN_SIZE) {
+        _mm256_stream_si256((__m256i*)(dst), v0);
+        _mm256_stream_si256((__m256i*)(dst + 32), v1);
+        _mm256_stream_si256((__m256i*)(dst + 64), v2);
+    }
+    if (vectorCount % 3 > 0)
+        _mm256_stream_si256((__m256i*)(dst), v0);
+    if (vectorCount % 3 > 1)
+        _mm256_stream_si256((__m256i*)(dst + 32), v1);
+    _mm_sfence();
+    _mm256_zeroupper();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CPUID feature bits
+///////////////////////////////////////////////////////////////////////////////
+bool cpuSupports(FillKernel kernel)
+{
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+    if (kernel == FILL_SSE2)
+        return __builtin_cpu_supports("sse2");
+    return __builtin_cpu_supports("avx2"); // also checks that the OS saves the AVX registers
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    if (kernel == FILL_SSE2)
+        return (info[3] & (1 << 26)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!osxsave || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return false;
+#endif
+}
+#endif
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// true if the CPU can run 'kernel'
+///////////////////////////////////////////////////////////////////////////////
+bool isFillKernelSupported(FillKernel kernel)
+{
+    switch (kernel) {
+    case FILL_SCALAR:
+        return true;
+#if defined(PIXEL_FILL_X86)
+    case FILL_SSE2:
+    case FILL_AVX2:
+    {
+        static int supported[FILL_KERNEL_COUNT] = { 0 }; // 0: unknown, 1: yes, -1: no
+        if (supported[kernel] == 0)
+            supported[kernel] = cpuSupports(kernel) ? 1 : -1;
+        return supported[kernel] > 0;
+    }
+#endif
+    default:
+        return false;
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// widest kernel supported by the CPU
+///////////////////////////////////////////////////////////////////////////////
+FillKernel getBestFillKernel()
+{
+    for (int i = FILL_KERNEL_COUNT - 1; i > FILL_SCALAR; --i) {
+        if (isFillKernelSupported((FillKernel)i))
+            return (FillKernel)i;
+    }
+    return FILL_SCALAR;
+}
+
+
+
+const char* getFillKernelName(FillKernel kernel)
+{
+    switch (kernel) {
+    case FILL_SCALAR:
+        return "Scalar";
+    case FILL_SSE2:
+        return "SSE2 non-temporal";
+    case FILL_AVX2:
+        return "AVX2 non-temporal";
+    default:
+        return "";
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// write 'count' pixels copied from 'pixel' at 'dst'
+// Runs too short for a few aligned blocks are written by the scalar kernel.
+// So are the 1-byte pixels: memset() was measured faster than the vector
+// kernels for R8 frames (2.2 ms instead of 5.9 ms per 4096x4096 frame).
+///////////////////////////////////////////////////////////////////////////////
+void fillPixels(FillKernel kernel, unsigned char* dst, const void* pixel, int bytesPerPixel, int count)
+{
+    size_t size = (size_t)count * bytesPerPixel;
+    if (kernel == FILL_SCALAR || bytesPerPixel == 1 || size < 4 * PATTERN_SIZE || PATTERN_SIZE % bytesPerPixel != 0) {
+        fillScalar(dst, pixel, bytesPerPixel, count);
+        return;
+    }
+
+#if defined(PIXEL_FILL_X86)
+    // Two periods, so that the period starting at any byte of the head is available
+    unsigned char pattern[2 * PATTERN_SIZE];
+    memcpy(pattern, pixel, bytesPerPixel);
+    for (int n = bytesPerPixel; n < 2 * PATTERN_SIZE; n *= 2) // double the pattern each time
+        memcpy(pattern + n, pattern, (n <= 2 * PATTERN_SIZE - n) ? n : 2 * PATTERN_SIZE - n);
+
+    size_t head = (CACHE_LINE_SIZE - ((size_t)dst & (CACHE_LINE_SIZE - 1))) & (CACHE_LINE_SIZE - 1);
+    memcpy(dst, pattern, head);
+
+    size_t lineCount = (size - head) / CACHE_LINE_SIZE;
+    if (kernel == FILL_AVX2)
+        streamAvx2(dst + head, pattern + head, lineCount);
+    else
+        streamSse2(dst + head, pattern + head, lineCount);
+
+    // The tail is shorter than a line, so it fits in the period starting at its offset
+    size_t done = head + lineCount * CACHE_LINE_SIZE;
+    memcpy(dst + done, pattern + done % PATTERN_SIZE, size - done);
+#else
+    fillScalar(dst, pixel, bytesPerPixel, count);
+#endif
+}
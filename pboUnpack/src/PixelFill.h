@@ -0,0 +1,37 @@
+///////////////////////////////////////////////////////////////////////////////
+// PixelFill.h
+// ===========
+// Kernels writing a run of identical pixels, used to generate the frames.
+// The frames are often written straight into mapped buffers that the driver
+// allocates as write-combined memory, where reads and partial cache line
+// writes are very slow. The SSE2 and AVX2 kernels write every whole cache
+// line of the run with aligned non-temporal (streaming) stores, so these lines
+// are fully written and nothing is read back. Only the partial lines at both
+// ends of the run go through normal stores. The scalar kernel writes one
+// pixel at a time through normal stores, or with memset() for 1-byte pixels,
+// which all the kernels use since it is faster for them.
+// The kernels available on the CPU are detected at runtime.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef PIXEL_FILL_H_DEF
+#define PIXEL_FILL_H_DEF
+
+enum FillKernel
+{
+    FILL_SCALAR = 0,
+    FILL_SSE2,
+    FILL_AVX2,
+    FILL_KERNEL_COUNT
+};
+
+bool isFillKernelSupported(FillKernel kernel);  // true if the CPU can run it
+FillKernel getBestFillKernel();                 // widest kernel supported
+const char* getFillKernelName(FillKernel kernel);
+
+// write 'count' pixels of 'bytesPerPixel' bytes (1, 2, 3, 4 or 8) copied from
+// 'pixel' at 'dst', which must be aligned to a pixel
+// The streaming stores are fenced before returning, so the pixels can be
+// handed to another thread or to the GL right after.
+void fillPixels(FillKernel kernel, unsigned char* dst, const void* pixel, int bytesPerPixel, int count);
+
+#endif // PIXEL_FILL_H_DEF
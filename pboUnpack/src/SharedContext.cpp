@@ -0,0 +1,214 @@
+///////////////////////////////////////////////////////////////////////////////
+// SharedContext.cpp
+// =================
+// Second OpenGL rendering context sharing its objects (buffers, textures,
+// sync objects) with the context that is current when create() is called.
+// The new context can then be made current on another thread.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "SharedContext.h"
+
+#if defined (__gnu_linux__)
+#include <EGL/egl.h>
+#include <GL/glx.h>
+#include <X11/Xlib.h>
+#include <cstring>
+#endif
+
+#include <iostream>
+using std::cout;
+using std::endl;
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// constructor
+///////////////////////////////////////////////////////////////////////////////
+SharedContext::SharedContext()
+    : egl(false)
+    , api(0)
+    , display(0)
+    , context(0)
+    , surface(0)
+    , drawable(0)
+{
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// destructor
+///////////////////////////////////////////////////////////////////////////////
+SharedContext::~SharedContext()
+{
+    destroy();
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// must be called before any other call to the window system
+///////////////////////////////////////////////////////////////////////////////
+void SharedContext::initThreads()
+{
+#if defined (__gnu_linux__)
+    XInitThreads();
+#endif
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// create a context in the share group of the calling thread's current context
+// It uses the same config as the current context, so that they are compatible.
+///////////////////////////////////////////////////////////////////////////////
+bool SharedContext::create()
+{
+    if (context)
+        return true;
+
+#if defined (__gnu_linux__)
+    EGLContext eglShare = eglGetCurrentContext();
+    if (eglShare != EGL_NO_CONTEXT) {
+        EGLDisplay eglDisplay = eglGetCurrentDisplay();
+        EGLint configId = 0;
+        eglQueryContext(eglDisplay, eglShare, EGL_CONFIG_ID, &configId);
+
+        EGLConfig config = 0; // configless context if the current one has no config either
+        if (configId != 0) {
+            EGLint attribs[] = { EGL_CONFIG_ID, configId, EGL_NONE };
+            EGLint configCount = 0;
+            if (!eglChooseConfig(eglDisplay, attribs, &config, 1, &configCount) || configCount < 1) {
+                cout << "ERROR [SharedContext::create] (eglChooseConfig): 0x" << std::hex << eglGetError() << std::dec << endl;
+                return false;
+            }
+        }
+
+        // The client API is a per-thread state, it is bound again in makeCurrent()
+        EGLenum eglApi = eglQueryAPI();
+        EGLContext eglContext = eglCreateContext(eglDisplay, config, eglShare, NULL);
+        if (eglContext == EGL_NO_CONTEXT) {
+            cout << "ERROR [SharedContext::create] (eglCreateContext): 0x" << std::hex << eglGetError() << std::dec << endl;
+            return false;
+        }
+
+        // The context never draws, so it needs no surface if the display allows it
+        EGLSurface eglSurface = EGL_NO_SURFACE;
+        const char* extensions = eglQueryString(eglDisplay, EGL_EXTENSIONS);
+        if (!extensions || !strstr(extensions, "EGL_KHR_surfaceless_context")) {
+            EGLint attribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+            eglSurface = eglCreatePbufferSurface(eglDisplay, config, attribs);
+            if (eglSurface == EGL_NO_SURFACE) {
+                cout << "ERROR [SharedContext::create] (eglCreatePbufferSurface): 0x" << std::hex << eglGetError() << std::dec << endl;
+                eglDestroyContext(eglDisplay, eglContext);
+                return false;
+            }
+        }
+
+        egl = true;
+        api = eglApi;
+        display = eglDisplay;
+        context = eglContext;
+        surface = eglSurface;
+        return true;
+    }
+
+    GLXContext glxShare = glXGetCurrentContext();
+    if (glxShare) {
+        Display* glxDisplay = glXGetCurrentDisplay();
+        int configId = 0;
+        int screen = 0;
+        glXQueryContext(glxDisplay, glxShare, GLX_FBCONFIG_ID, &configId);
+        glXQueryContext(glxDisplay, glxShare, GLX_SCREEN, &screen);
+
+        int attribs[] = { GLX_FBCONFIG_ID, configId, None };
+        int configCount = 0;
+        GLXFBConfig* configs = glXChooseFBConfig(glxDisplay, screen, attribs, &configCount);
+        if (!configs || configCount < 1) {
+            cout << "ERROR [SharedContext::create] (glXChooseFBConfig): no matching config" << endl;
+            return false;
+        }
+        GLXContext glxContext = glXCreateNewContext(glxDisplay, configs[0], GLX_RGBA_TYPE, glxShare, True);
+        XFree(configs);
+        if (!glxContext) {
+            cout << "ERROR [SharedContext::create] (glXCreateNewContext): failed" << endl;
+            return false;
+        }
+
+        // The context never draws, it is bound to the window only because GLX needs a drawable
+        egl = false;
+        display = glxDisplay;
+        context = glxContext;
+        drawable = glXGetCurrentDrawable();
+        return true;
+    }
+#endif
+
+    return false;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// delete the context
+///////////////////////////////////////////////////////////////////////////////
+void SharedContext::destroy()
+{
+    if (!context)
+        return;
+
+#if defined (__gnu_linux__)
+    if (egl) {
+        if (surface)
+            eglDestroySurface((EGLDisplay)display, (EGLSurface)surface);
+        eglDestroyContext((EGLDisplay)display, (EGLContext)context);
+    }
+    else {
+        glXDestroyContext((Display*)display, (GLXContext)context);
+    }
+#endif
+
+    context = surface = 0;
+    drawable = 0;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// bind the context to the calling thread
+///////////////////////////////////////////////////////////////////////////////
+bool SharedContext::makeCurrent()
+{
+    if (!context)
+        return false;
+
+#if defined (__gnu_linux__)
+    if (egl) {
+        eglBindAPI(api);
+        return eglMakeCurrent((EGLDisplay)display, (EGLSurface)surface, (EGLSurface)surface, (EGLContext)context) == EGL_TRUE;
+    }
+    else {
+        return glXMakeContextCurrent((Display*)display, drawable, drawable, (GLXContext)context) == True;
+    }
+#else
+    return false;
+#endif
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// unbind the context from the calling thread
+///////////////////////////////////////////////////////////////////////////////
+void SharedContext::doneCurrent()
+{
+    if (!context)
+        return;
+
+#if defined (__gnu_linux__)
+    if (egl)
+        eglMakeCurrent((EGLDisplay)display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    else
+        glXMakeContextCurrent((Display*)display, None, None, NULL);
+#endif
+}
@@ -0,0 +1,45 @@
+///////////////////////////////////////////////////////////////////////////////
+// SharedContext.h
+// ===============
+// Second OpenGL rendering context sharing its objects (buffers, textures,
+// sync objects) with the context that is current when create() is called.
+// The new context can then be made current on another thread.
+//
+// On Linux, an EGL context is shared if the current context was created with
+// EGL (e.g. freeglut on Wayland), otherwise a GLX context is shared. Since
+// two threads use Xlib with GLX, initThreads() must be called before the
+// display is opened (before glutInit()).
+// Other platforms are not supported: create() returns false.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef SHARED_CONTEXT_H_DEF
+#define SHARED_CONTEXT_H_DEF
+
+
+class SharedContext
+{
+public:
+    SharedContext();                            // default constructor
+    ~SharedContext();                           // destructor, calls destroy()
+
+    static void initThreads();                  // enable multi-threaded use of the window system
+
+    bool create();                              // create a context sharing with the current one
+    void destroy();                             // delete the context, must not be current anywhere
+    bool makeCurrent();                         // bind the context to the calling thread
+    void doneCurrent();                         // unbind any context from the calling thread
+    bool isCreated() const                      { return context != 0; }
+
+private:
+    SharedContext(const SharedContext&);        // not copyable
+    SharedContext& operator=(const SharedContext&);
+
+    bool egl;                                   // true for EGL, false for GLX
+    unsigned int api;                           // EGL client API of the shared context
+    void* display;                              // EGLDisplay or X11 Display*
+    void* context;                              // EGLContext or GLXContext
+    void* surface;                              // EGLSurface (none if surfaceless)
+    unsigned long drawable;                     // GLXDrawable
+};
+
+#endif // SHARED_CONTEXT_H_DEF
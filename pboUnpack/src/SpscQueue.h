@@ -0,0 +1,59 @@
+///////////////////////////////////////////////////////////////////////////////
+// SpscQueue.h
+// ===========
+// Lock-free bounded queue for one producer thread and one consumer thread.
+// push() must only be called from the producer and pop() from the consumer.
+// Both return false instead of blocking when the queue is full or empty.
+// Everything written by the producer before push() is visible to the
+// consumer after the matching pop().
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef SPSC_QUEUE_H_DEF
+#define SPSC_QUEUE_H_DEF
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+
+template <typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(size_t capacity = 16)    // max amount of queued items
+        : items(capacity + 1), head(0), tail(0) {}
+
+    bool push(const T& item)                    // add an item (producer side)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t next = (t + 1) % items.size();
+        if (next == head.load(std::memory_order_acquire))
+            return false;                       // full
+        items[t] = item;
+        tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item)                           // remove the oldest item (consumer side)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;                       // empty
+        item = items[h];
+        head.store((h + 1) % items.size(), std::memory_order_release);
+        return true;
+    }
+
+    // Only valid while neither thread is using the queue
+    void clear()                                { head.store(0); tail.store(0); }
+
+private:
+    SpscQueue(const SpscQueue&);                // not copyable
+    SpscQueue& operator=(const SpscQueue&);
+
+    std::vector<T> items;                       // ring storage, one slot is kept empty
+    std::atomic<size_t> head;                   // next item to pop, written by the consumer
+    std::atomic<size_t> tail;                   // next slot to push, written by the producer
+};
+
+#endif // SPSC_QUEUE_H_DEF
@@ -0,0 +1,97 @@
+///////////////////////////////////////////////////////////////////////////////
+// StagingPool.cpp
+// ===============
+// Staging buffers released by a configuration, kept for the next one.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "StagingPool.h"
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// constructor
+///////////////////////////////////////////////////////////////////////////////
+StagingPool::StagingPool(Destroy destroy, size_t capacity)
+    : destroy(destroy)
+    , capacity(capacity)
+    , size(0)
+    , hitCount(0)
+    , missCount(0)
+{
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// destructor
+// The buffers may need a context that no longer exists at this point, so
+// they are only destroyed by clear().
+///////////////////////////////////////////////////////////////////////////////
+StagingPool::~StagingPool()
+{
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// take the most recently released buffer matching 'size' and 'usage'
+///////////////////////////////////////////////////////////////////////////////
+bool StagingPool::acquire(size_t size, unsigned int usage, StagingBuffer& buffer)
+{
+    for (size_t i = buffers.size(); i > 0; --i) {
+        if (buffers[i - 1].size == size && buffers[i - 1].usage == usage) {
+            buffer = buffers[i - 1];
+            buffers.erase(buffers.begin() + (i - 1));
+            this->size -= size;
+            ++hitCount;
+            return true;
+        }
+    }
+    ++missCount;
+    return false;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// keep a buffer no longer used, then destroy the oldest ones over capacity
+///////////////////////////////////////////////////////////////////////////////
+void StagingPool::release(const StagingBuffer& buffer)
+{
+    if (buffer.size > capacity) {
+        destroy(buffer);
+        return;
+    }
+
+    buffers.push_back(buffer);
+    size += buffer.size;
+    trim(capacity);
+}
+
+
+
+void StagingPool::clear()
+{
+    trim(0);
+}
+
+
+
+void StagingPool::setCapacity(size_t capacity)
+{
+    this->capacity = capacity;
+    trim(capacity);
+}
+
+
+
+void StagingPool::trim(size_t maxSize)
+{
+    size_t count = 0;
+    while (size > maxSize && count < buffers.size()) {
+        size -= buffers[count].size;
+        destroy(buffers[count]);
+        ++count;
+    }
+    buffers.erase(buffers.begin(), buffers.begin() + count);
+}
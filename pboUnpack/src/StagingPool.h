@@ -0,0 +1,73 @@
+///////////////////////////////////////////////////////////////////////////////
+// StagingPool.h
+// =============
+// Staging buffers released by a configuration, kept for the next one.
+// Creating a 64-256 MB buffer costs its allocation, the faults of all its
+// pages and, with the persistent methods, its mapping. A method switch or a
+// PBO count change pays all of it again for buffers it has just deleted.
+//
+// The buffers are matched by size and usage, a key of the caller telling how
+// they were created (e.g. storage flags). The most recently released one is
+// handed back first. Past the capacity, the buffers released the longest
+// time ago are destroyed by the callback given to the constructor, on the
+// thread calling release(), clear() or setCapacity().
+// A buffer may still be read by the GPU when it is released: the caller
+// stores a fence in it then, and waits for it when the buffer is acquired.
+// Not thread safe: all the calls must come from the same thread.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef STAGING_POOL_H_DEF
+#define STAGING_POOL_H_DEF
+
+#include <cstddef>
+#include <vector>
+
+struct StagingBuffer
+{
+    unsigned int id;                            // buffer object, 0 for system memory only
+    unsigned char* ptr;                         // mapping or system memory, NULL if none
+    size_t size;                                // bytes
+    unsigned int usage;                         // how the buffer was created, defined by the caller
+    int pages;                                  // pages backing 'ptr', for the caller
+    void* fence;                                // last GPU use (e.g. GLsync) to wait for before reuse, NULL if none
+};
+
+
+class StagingPool
+{
+public:
+    typedef void (*Destroy)(const StagingBuffer& buffer);
+
+    StagingPool(Destroy destroy, size_t capacity);
+    ~StagingPool();                             // destructor, does NOT destroy the buffers left, see clear()
+
+    // take a buffer of 'size' bytes created for 'usage', false if none is kept
+    bool acquire(size_t size, unsigned int usage, StagingBuffer& buffer);
+    void release(const StagingBuffer& buffer);  // keep the buffer, or destroy it if it does not fit
+    void clear();                               // destroy all the buffers kept
+
+    void setCapacity(size_t capacity);          // bytes kept at most, 0: destroy on release
+    size_t getCapacity() const                  { return capacity; }
+    size_t getSize() const                      { return size; }
+    int getBufferCount() const                  { return (int)buffers.size(); }
+
+    // acquire() calls that found a buffer, or not, since resetCounts()
+    int getHitCount() const                     { return hitCount; }
+    int getMissCount() const                    { return missCount; }
+    void resetCounts()                          { hitCount = missCount = 0; }
+
+private:
+    StagingPool(const StagingPool&);            // not copyable
+    StagingPool& operator=(const StagingPool&);
+
+    void trim(size_t maxSize);                  // destroy the oldest buffers over maxSize bytes
+
+    Destroy destroy;
+    std::vector<StagingBuffer> buffers;         // oldest released first
+    size_t capacity;
+    size_t size;                                // bytes of all the buffers kept
+    int hitCount;
+    int missCount;
+};
+
+#endif // STAGING_POOL_H_DEF
@@ -0,0 +1,129 @@
+///////////////////////////////////////////////////////////////////////////////
+// WorkerPool.cpp
+// ==============
+// Persistent threads splitting a task among themselves and the calling
+// thread.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "WorkerPool.h"
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// constructor
+///////////////////////////////////////////////////////////////////////////////
+WorkerPool::WorkerPool()
+    : task(0)
+    , arg(0)
+    , generation(0)
+    , taskCount(1)
+    , pendingCount(0)
+    , stopping(false)
+{
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// destructor
+///////////////////////////////////////////////////////////////////////////////
+WorkerPool::~WorkerPool()
+{
+    stop();
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// (re)create the threads, the calling thread counts as one of them
+///////////////////////////////////////////////////////////////////////////////
+void WorkerPool::start(int threadCount)
+{
+    stop();
+
+    // The threads only wait for the runs after this one, even if they start late
+    std::lock_guard<std::mutex> runLock(runMutex);
+    stopping = false;
+    for (int i = 1; i < threadCount; ++i)
+        threads.push_back(std::thread(&WorkerPool::loop, this, i, generation));
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// wake up all the threads to exit, and wait for them
+///////////////////////////////////////////////////////////////////////////////
+void WorkerPool::stop()
+{
+    std::lock_guard<std::mutex> runLock(runMutex);
+    if (threads.empty())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    startCondition.notify_all();
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+    threads.clear();
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// call task(i, count, arg) on each thread, index 0 on the calling thread
+///////////////////////////////////////////////////////////////////////////////
+void WorkerPool::run(Task task, void* arg)
+{
+    std::lock_guard<std::mutex> runLock(runMutex);
+    int count = (int)threads.size() + 1;
+    if (count > 1) {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->task = task;
+        this->arg = arg;
+        taskCount = count;
+        pendingCount = count - 1;
+        ++generation;
+    }
+    startCondition.notify_all();
+
+    task(0, count, arg);
+
+    if (count > 1) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (pendingCount > 0)
+            doneCondition.wait(lock);
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// wait for a task, run its part 'index', signal the caller when the last one
+///////////////////////////////////////////////////////////////////////////////
+void WorkerPool::loop(int index, unsigned int lastGeneration)
+{
+    while (true) {
+        Task currentTask;
+        void* currentArg;
+        int count;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stopping && generation == lastGeneration)
+                startCondition.wait(lock);
+            if (stopping)
+                return;
+            lastGeneration = generation;
+            currentTask = task;
+            currentArg = arg;
+            count = taskCount;
+        }
+
+        currentTask(index, count, currentArg);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--pendingCount == 0)
+            doneCondition.notify_one();
+    }
+}
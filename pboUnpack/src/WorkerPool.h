@@ -0,0 +1,54 @@
+///////////////////////////////////////////////////////////////////////////////
+// WorkerPool.h
+// ============
+// Persistent threads splitting a task among themselves and the calling
+// thread. run() calls task(index, count, arg) once for each index in
+// [0, count), one index per thread, and returns only when all the calls are
+// done, so it is also a barrier: everything the tasks wrote is visible to the
+// caller when run() returns.
+// The threads are kept between the calls and sleep while there is no task.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef WORKER_POOL_H_DEF
+#define WORKER_POOL_H_DEF
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+class WorkerPool
+{
+public:
+    typedef void (*Task)(int index, int count, void* arg);
+
+    WorkerPool();                               // no thread, run() calls the task on the caller only
+    ~WorkerPool();                              // destructor, calls stop()
+
+    void start(int threadCount);                // threadCount - 1 threads plus the caller
+    void stop();                                // join all the threads
+    int getThreadCount() const                  { return (int)threads.size() + 1; }
+
+    void run(Task task, void* arg);             // split the task among all threads, then wait
+
+private:
+    WorkerPool(const WorkerPool&);              // not copyable
+    WorkerPool& operator=(const WorkerPool&);
+
+    void loop(int index, unsigned int lastGeneration); // body of each thread
+
+    std::vector<std::thread> threads;
+    std::mutex runMutex;                        // one run() at a time
+    std::mutex mutex;                           // protects the members below
+    std::condition_variable startCondition;     // a new task or stop
+    std::condition_variable doneCondition;      // the last thread finished
+    Task task;
+    void* arg;
+    unsigned int generation;                    // incremented by each run()
+    int taskCount;                              // threads sharing the task
+    int pendingCount;                           // threads still running the task
+    bool stopping;
+};
+
+#endif // WORKER_POOL_H_DEF
@@ -30,15 +30,30 @@
 #include <sstream>
 #include <iomanip>
 #include <vector>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <string>
+#include <fstream>
+#include <algorithm>
 
 #if defined(_WIN32)
 #include <windows.h> // GetSystemInfo
 #elif defined (__gnu_linux__)
 #include <unistd.h> // sysconf
+#include <EGL/egl.h> // headless mode
+#include <EGL/eglext.h>
 #endif
 
 #include "glInfo.h" // glInfo struct
 #include "Timer.h"
+#include "SpscQueue.h"
+#include "LatencyHistogram.h"
+#include "PixelFill.h"
+#include "WorkerPool.h"
+#include "HostMemory.h"
+#include "StagingPool.h"
+#include "SharedContext.h"
 #include "glext.h"
 #define GL_EXTERNAL_VIRTUAL_MEMORY_BUFFER_AMD 0x9160
 
@@ -64,23 +79,95 @@ void exitCB(); // CALLBACK function when exit() is called
 
 // Program functions //////////////////////////////////////////////////////////
 void initGL();
+void initTexture();
+bool initImageFormat(int width, int height, int formatIdx);
+bool setImageFormat(int width, int height, int formatIdx);
+bool checkMaxTextureSize(int width, int height);
+int findPixelFormat(const std::string& name);
+int findFillKernel(const std::string& name);
+bool parseSize(const std::string& text, int& width, int& height);
+void clearTextures();
 int  initGLUT(int argc, char **argv);
+bool initEGL();
+void runHeadless();
+void runMatrix();
+void runCalibration();
+bool parseArguments(int argc, char **argv);
+bool parseIntList(const char* text, std::vector<int>& values);
+void printUsage(const char* program);
 bool initSharedMem();
 void clearSharedMem();
 void initLights();
 void setCamera(float posX, float posY, float posZ, float targetX, float targetY, float targetZ);
 void updatePixels(GLubyte* dst, int size);
+void beginPixelUpdate();
+void updatePixelBand(GLubyte* dst, int firstRow, int rowCount);
+void updatePixelRows(GLubyte* dst, int firstRow, int rowCount);
+void fillRowsTask(int index, int count, void* arg);
+void setFillThreadCount(int count);
+void endPixelUpdate();
+int getPartialRowCount();
 void drawString(const char *str, int x, int y, float color[4], void *font);
 void drawString3D(const char *str, float pos[3], float color[4], void *font);
 void showInfo();
 void showTransferRate();
 void printTransferRate();
 void resetTransferRate();
+void printLatencySummary();
+void printPagePlacement();
+void printPercentiles(const char* name, const LatencyHistogram& histogram);
+std::string getConfigLabel();
+void initGpuTimers();
+void clearGpuTimers();
+void beginGpuTimer();
+void endGpuTimer();
+void collectGpuTimers(bool wait);
 
 /* 'alignment' must be a power of 2. */
 void* alignedMalloc(size_t alignment, size_t size);
 void alignedFree(void* ptr);
+GLubyte* allocStagingBuffer(size_t size, HugePages* usedMode);
+void freeStagingBuffer(GLubyte* ptr);
+bool allocImageData();
+void setHugePages(HugePages mode);
+void reallocateBuffers();
+void prefaultBuffer(GLubyte* ptr, size_t size);
+void touchPagesTask(int index, int count, void* arg);
+void releaseImageData();
+void destroyStagingBuffer(const StagingBuffer& buffer);
+void fenceStagingBuffer(StagingBuffer& buffer);
+void waitStagingBuffer(StagingBuffer& buffer);
+unsigned int getPboUsage();
+void setStagingPoolEnabled(bool enabled);
+void startReconfigure();
+double stopReconfigure(const char* change);
+void markReallocation();
+void printFirstFrames();
+int findHugePages(const std::string& name);
 void setPboCount(int count);
+void setPboRingCount(int count);
+GLuint getPboId(int idx);
+GLintptr getPboOffset(int idx);
+void waitPboFence(int idx);
+void waitTextureFence(int idx);
+struct FenceCounters;
+void waitFence(GLsync& fence, FenceCounters& counters);
+void countFenceWait(GLenum result, double waitTime, FenceCounters& counters);
+struct FenceWaits;
+void readFenceCounters(const FenceCounters& counters, FenceWaits& waits);
+FenceWaits getFenceWaitsSince(const FenceCounters& counters, const FenceWaits& begin);
+void printFenceWaits(const char* name, const FenceWaits& waits, double elapsedTime);
+void adaptPboCount(long long fenceWaits, long long fenceStalls, double blockedTime);
+void applyAdaptivePboCount();
+void resetAdaptivePboCount();
+GLubyte* getPboPointer(int idx);
+void startProducer();
+void stopProducer();
+void producerLoop();
+void recycleSlots(bool wait);
+void startUploadWorker();
+void stopUploadWorker();
+void uploadWorkerLoop();
 
 // Program Constants //////////////////////////////////////////////////////////
 //const int    SCREEN_WIDTH    = 400;
@@ -90,19 +177,114 @@ const int    SCREEN_HEIGHT   = 600;
 const float  CAMERA_DISTANCE = 3.0f;
 const int    TEXT_WIDTH      = 8;
 const int    TEXT_HEIGHT     = 13;
-//const int    IMAGE_WIDTH = 1024;
-//const int    IMAGE_HEIGHT = 1024;
-//const int    IMAGE_WIDTH = 8192;
-//const int    IMAGE_HEIGHT = 8192; // 8192*8192*4 = 256 MB each frame
-const int    IMAGE_WIDTH = 4096;
-const int    IMAGE_HEIGHT = 4096; // 4096*4096*4 = 64 MB each frame
-const int    DATA_SIZE = IMAGE_WIDTH * IMAGE_HEIGHT * 4;
-const GLenum PIXEL_FORMAT = GL_BGRA;
+const int    MAX_TEXTURE_COUNT = 4;
+const int    MAX_BAND_COUNT = 16;
+
+// Pixel formats of the frames, selected with --format or the 'f' key
+struct PixelFormat {
+    const char* name;
+    GLenum format;                  // client pixel format...
+    GLenum type;                    // ...and type of the frames
+    GLenum internalFormat;          // storage of the textures
+    int bytesPerPixel;
+};
+const PixelFormat PIXEL_FORMATS[] = {
+    { "BGRA8",   GL_BGRA, GL_UNSIGNED_BYTE,  GL_RGBA8,   4 },
+    { "RGBA8",   GL_RGBA, GL_UNSIGNED_BYTE,  GL_RGBA8,   4 },
+    { "RGB8",    GL_RGB,  GL_UNSIGNED_BYTE,  GL_RGB8,    3 },
+    { "R8",      GL_RED,  GL_UNSIGNED_BYTE,  GL_R8,      1 },
+    { "R16",     GL_RED,  GL_UNSIGNED_SHORT, GL_R16,     2 },
+    { "RGBA16F", GL_RGBA, GL_HALF_FLOAT,     GL_RGBA16F, 8 }
+};
+const int PIXEL_FORMAT_COUNT = sizeof(PIXEL_FORMATS) / sizeof(PIXEL_FORMATS[0]);
+
+// Frame sizes cycled with the 's' key
+const int FRAME_SIZES[][2] = {
+    { 1024, 1024 },
+    { 1920, 1080 },                 // 1080p
+    { 3840, 2160 },                 // 4K UHD
+    { 4096, 4096 },
+    { 7680, 4320 },                 // 8K UHD
+    { 8192, 8192 }                  // 8192*8192*4 = 256 MB each frame
+};
+const int FRAME_SIZE_COUNT = sizeof(FRAME_SIZES) / sizeof(FRAME_SIZES[0]);
 
 // Global Variables ///////////////////////////////////////////////////////////
 void* font = GLUT_BITMAP_8_BY_13;
-GLuint textureId;                   // ID of texture
+int textureCount = 1;               // Amount of textures used as a round-robin ring
+std::vector<GLuint> textureIds;     // IDs of textures
+std::vector<GLsync> textureFences;  // Sync Fences protecting each texture while it is being drawn
+bool textureImmutable = false;      // true if the textures were created with immutable storage
+int copyTextureIdx = 0;             // Texture that receives the new pixels in this frame
+int drawTextureIdx = 0;             // Texture that is drawn in this frame
+int pixelColor = 0;                 // Value of the first row of the frame being written
+int partialRow = 0;                 // First row of the strip written by UPDATE_PARTIAL
 GLubyte* imageData = NULL;             // pointer to texture buffer
+
+// Frame geometry, see initImageFormat() and setImageFormat()
+int imageWidth = 4096;
+int imageHeight = 4096;             // 4096*4096*4 = 64 MB each frame
+int pixelFormatIdx = 0;             // index in PIXEL_FORMATS, BGRA8
+GLenum pixelFormat = GL_BGRA;
+GLenum pixelType = GL_UNSIGNED_BYTE;
+GLenum textureFormat = GL_RGBA8;    // internal format of the textures
+int bytesPerPixel = 4;
+int dataSize = imageWidth * imageHeight * bytesPerPixel;
+
+// Kernel writing the pixels, the widest one supported unless --fill is given
+// Toggled with 'k' to compare the Updating Time.
+const char* FILL_KERNEL_OPTIONS[] = { "scalar", "sse2", "avx2" }; // --fill names of FillKernel
+FillKernel fillKernel = FILL_SCALAR;
+bool fillKernelSet = false;         // true if --fill was given
+
+// Threads writing the pixels, each one fills a band of rows of the frame (see
+// updatePixelRows()). The calling thread is one of them, so 1 means no pool.
+// Toggled with 'w' to compare the Updating Time. A single thread by default,
+// as the original sample, so that the results stay comparable with it.
+const int MAX_FILL_THREADS = 64;
+int fillThreadCount = 1;
+WorkerPool fillPool;
+
+// Pages of imageData and of the AMD_pinned_memory buffers, system pages
+// unless --huge-pages is given. Toggled with 'h' to compare the dTLB misses.
+const char* HUGE_PAGES_OPTIONS[] = { "off", "thp", "2mb", "1gb" }; // --huge-pages names of HugePages
+HugePages hugePages = HUGE_PAGES_OFF;   // requested, smaller pages are used if not available
+HugePages imageDataPages = HUGE_PAGES_OFF; // used by imageData
+bool memoryCountersOpen = false;    // true if the dTLB misses of the threads are counted
+
+// NUMA node of the threads and of the system memory buffers (--numa-node),
+// -1 to leave the placement to the system
+int numaNode = -1;
+const int PAGE_PLACEMENT_SAMPLES = 4096; // pages sampled in each buffer by printPagePlacement()
+
+// Fault in and lock the staging buffers as soon as they are created, instead
+// of faulting page by page in the first frames (--prefault or 'l' key).
+// The pages are touched by the fill threads, then locked with mlock().
+bool prefaultEnabled = false;
+bool lockFailed = false;            // mlock() failed once, e.g. over "ulimit -l"
+
+// Update + copy time of the first frames after the buffers were reallocated,
+// hidden by the discarded seconds of the transfer rates (see markReallocation())
+int firstFrameCount = 10;           // --first-frames, 0: not measured
+std::vector<float> firstFrameTimes;
+bool firstFramesPending = false;    // firstFrameTimes is being filled
+
+// Staging buffers released by a reconfiguration (PBO method or count, frame
+// format) are kept in stagingPool and handed back to the next one, instead of
+// being deleted and created again (--staging-pool MB, toggled with 'o').
+// Each reconfiguration from the keyboard prints its hitch time.
+enum StagingUsage {
+    STAGING_SYSTEM = 1,             // system memory from allocStagingBuffer()
+    STAGING_PINNED,                 // AMD_pinned_memory buffer object with its system memory
+    STAGING_MUTABLE,                // glBufferData() storage
+    STAGING_COHERENT,               // immutable storage, persistent coherent mapping
+    STAGING_FLUSH                   // immutable storage, persistent mapping flushed explicitly
+};
+const int DEFAULT_STAGING_POOL_MB = 1024;
+int stagingPoolMB = DEFAULT_STAGING_POOL_MB;   // capacity of the pool when enabled
+bool stagingPoolEnabled = true;
+StagingPool stagingPool(destroyStagingBuffer, (size_t)DEFAULT_STAGING_POOL_MB * 1024 * 1024);
+Timer reconfigureTimer;             // see startReconfigure()
 int screenWidth;
 int screenHeight;
 bool mouseLeftDown;
@@ -116,6 +298,131 @@ float cameraDistance;
 int drawMode = 0;
 Timer timer, t1, t2;
 float copyTime, updateTime;
+float waitTime = 0; // Time the GL thread waited for the producer thread
+float frameTime = 0; // Time between the start of the previous frame and this one
+long long flushedBytes = 0; // Bytes flushed with glFlushMappedBufferRange() since the last report
+std::atomic<long long> copiedBytes(0); // Bytes copied to the texture since the last report
+
+// Fence wait accounting, totals of every blocking glClientWaitSync()
+// A wait ending with GL_CONDITION_SATISFIED (or a timeout) is a stall: the CPU
+// caught up with the GPU and had to block. They are updated by the GL thread
+// and the upload worker thread.
+// The waits for a PBO to be free again, which more PBOs can avoid, are
+// counted apart from the waits for a texture of the ring, which they cannot.
+struct FenceCounters {
+    std::atomic<long long> waitCount;        // all waits
+    std::atomic<long long> signaledCount;    // GL_ALREADY_SIGNALED, no stall
+    std::atomic<long long> stallCount;       // GL_CONDITION_SATISFIED or GL_TIMEOUT_EXPIRED
+    std::atomic<long long> failedCount;      // GL_WAIT_FAILED
+    std::atomic<long long> waitMicroSeconds; // time spent in the waits
+};
+FenceCounters pboFenceCounters;             // see waitPboFence(), zero initialized
+FenceCounters textureFenceCounters;         // see waitTextureFence()
+FenceCounters stagingFenceCounters;         // see waitStagingBuffer(), reported with the reconfigurations only
+
+// Fence waits counted over a period of time, see getFenceWaitsSince()
+struct FenceWaits {
+    long long waitCount;
+    long long signaledCount;
+    long long stallCount;
+    long long failedCount;
+    long long waitMicroSeconds;
+};
+FenceWaits stagingFenceWaitsBegin;          // see startReconfigure()
+
+// Adaptive PBO count, toggled with 'a' (fenced methods only)
+// Every second, the ring grows by one PBO when too many fence waits stall or
+// block too long, and shrinks by one when the waits were all signaled already
+// for a while. Growing and shrinking have their own thresholds and amount of
+// seconds in a row, and a count that stalled is retried much later, so the
+// count does not oscillate. Each PBO costs dataSize bytes.
+const int    ADAPTIVE_MIN_PBO_COUNT = 1;
+const int    ADAPTIVE_MAX_PBO_COUNT = 8;
+const double ADAPTIVE_GROW_STALL_RATE = 0.25;   // grow above 25% of stalled waits...
+const double ADAPTIVE_GROW_BLOCKED_TIME = 50;   // ...or above 50 ms blocked per second
+const int    ADAPTIVE_GROW_SECONDS = 2;         // during 2 seconds in a row
+const double ADAPTIVE_SHRINK_BLOCKED_TIME = 1;  // shrink without stall and below 1 ms/s blocked...
+const int    ADAPTIVE_SHRINK_SECONDS = 10;      // ...during 10 seconds in a row
+const int    ADAPTIVE_RETRY_SECONDS = 60;       // ...or 60 seconds to go back to a count that stalled
+bool adaptivePboCount = false;
+int adaptiveGrowSeconds = 0;    // seconds in a row above the grow thresholds
+int adaptiveShrinkSeconds = 0;  // seconds in a row below the shrink thresholds
+int adaptiveStalledCount = 0;   // largest PBO count that stalled
+int adaptivePendingCount = 0;   // PBO count applied after the frame, see applyAdaptivePboCount() (0: none)
+int bandCount = 4; // Amount of horizontal bands used by the BANDED method
+
+// GPU timing of the copies (ARB_timer_query)
+// Each copy issued by the GL thread is wrapped in a GL_TIME_ELAPSED query
+// taken from a ring. The results are read back a few frames later, once they
+// are available, so the CPU never waits for the GPU to measure it.
+const int GPU_TIMER_QUERY_COUNT = 64;
+bool timerQuerySupported = false;
+std::vector<GLuint> gpuTimerQueries;
+std::vector<long long> gpuTimerBytes;   // bytes copied inside each query
+unsigned int gpuTimerHead = 0;          // amount of queries issued
+unsigned int gpuTimerTail = 0;          // amount of queries read back
+long long gpuTimerBytesBegin = 0;       // copiedBytes when the current query began
+long long gpuCopyNanoSeconds = 0;       // total GPU time of the queries read back
+long long gpuCopyBytes = 0;             // total bytes copied during these queries
+float gpuCopyTime = 0;                  // ms per frame, last report
+float gpuCopyRate = 0;                  // MB/s while copying, last report
+
+// Command line options, see printUsage()
+int startMethod = -1;        // PBO method selected at startup (-1: keep NONE)
+int startPboCount = 1;       // PBO count of the method selected at startup
+bool startPboCountSet = false; // true if --pbo was given
+
+// Calibration: without --method, every supported method is timed for a few
+// frames at startup and the fastest one is selected, see runCalibration()
+const int CALIBRATION_WARMUP_FRAMES = 3;
+const int CALIBRATION_FRAMES = 12;
+const int CALIBRATION_P99_FRAMES = 100; // with --calibrate-by p99: fewer frames would only give the max
+const int CALIBRATION_PBO_COUNT = 2;   // unless --pbo is given
+bool calibrationEnabled = true;
+bool calibrationByP99 = false;         // lowest p99 frame time instead of highest throughput
+bool calibrating = false;              // frames are not presented, see runCalibration()
+
+// Headless mode: EGL context without any window, see initEGL() and runHeadless()
+bool headless = false;
+int headlessFrames = 0;      // stop after this amount of frames (0: no limit)
+double headlessSeconds = 0;  // stop after this amount of seconds (0: no limit)
+GLuint headlessFbo = 0;      // framebuffer drawn to when the context has no surface
+
+// Benchmark matrix: every combination of the listed methods and PBO counts
+// is held for a warmup then a measurement window, and produces one record.
+bool matrixMode = false;
+std::vector<int> matrixMethods;        // empty: all supported methods
+std::vector<int> matrixPboCounts;      // empty: 1, 2 and 3 PBOs
+std::vector<int> matrixSizes;          // width, height pairs (empty: --size only)
+std::vector<int> matrixFormats;        // PIXEL_FORMATS indices (empty: --format only)
+std::vector<int> matrixFillKernels;    // FillKernel values (empty: current kernel only)
+std::vector<int> matrixFillThreads;    // fill thread counts (empty: --threads only)
+std::vector<int> matrixHugePages;      // HugePages values (empty: --huge-pages only)
+double matrixWarmupSeconds = 1;
+double matrixMeasureSeconds = 3;
+bool matrixJson = false;               // JSON Lines records instead of CSV
+std::string matrixOutput;              // file receiving the records (empty: standard output)
+std::streambuf* matrixStdout = NULL;   // standard output when cout is sent to the standard error
+
+// Result of a headless run, see runFrames()
+struct RunResult {
+    int frameCount;
+    double elapsedTime;                // seconds
+    double updateTime, copyTime;       // average per frame, in ms
+    double updateSpeedup;              // update time with the first fill thread count / this one (< 0: not compared)
+    double gpuCopyTime;                // GPU time of the copies per frame, in ms (< 0: not measured)
+    double gpuCopyRate;                // MB/s while the GPU copies
+    FenceWaits pboFenceWaits;          // blocking waits for a PBO to be free again
+    FenceWaits textureFenceWaits;      // blocking waits for a texture of the ring
+    double dtlbMisses;                 // dTLB misses of all the threads per frame (< 0: not counted)
+    long long pageFaults;              // minor and major page faults of the process (< 0: not counted)
+    double reconfigureTime;            // ms to switch the buffers to this configuration (< 0: not measured)
+    LatencyHistogram updateHistogram;  // per-frame timings
+    LatencyHistogram copyHistogram;
+    LatencyHistogram frameHistogram;   // time between the starts of two frames, see frameTime
+};
+RunResult runFrames(int frames, double seconds);
+void writeRecord(std::ostream& out, const RunResult& result);
 
 // See resetTransferRate()
 static int rateDiscarded = 3; // Discard first measurements
@@ -123,13 +430,25 @@ static int rateCount = 0;
 static double transferRateSum = 0;
 static double frameRateSum = 0;
 
+// Per-frame timings of the current configuration, after the discarded seconds
+// The running averages hide the stalls, the percentiles show them.
+LatencyHistogram updateHistogram;
+LatencyHistogram copyHistogram;
+LatencyHistogram frameHistogram;
+std::string latencyLabel; // configuration being recorded
+
 bool pboSupported = false;
 bool amdSupported = false;
+bool storageSupported = false;
+bool invalidateSupported = false;
+bool dsaSupported = false;
 long int systemPageSize = 4096; // Default value, will be checked at runtime
 int pboCount = 0; // Amount of Pixel Buffer Objects used
 std::vector<GLuint> pboIds; // IDs of Pixel Buffer Objects
 std::vector<GLsync> pboFences; // Sync Fences used for the UNSYNCH_FENCES method
 std::vector<GLubyte*> alignedBuffers; // Buffers used for the AMD_pinned_memory method
+std::vector<GLubyte*> pboPointers; // Persistent mappings used for the PERSISTENT_* methods
+GLsizeiptr pboSlotSize = 0; // Size of each slot (data plus alignment padding) of the PERSISTENT_RING buffer
 
 /* Texture Streaming methods:
  * 0: No streaming at all. Just load texture data from the System Memory.
@@ -137,9 +456,80 @@ std::vector<GLubyte*> alignedBuffers; // Buffers used for the AMD_pinned_memory
  * 2: Use Unsynchronized Buffer Update with Orphaning.
  * 3: Use Unsynchronized Buffer Update with Fences synchronization.
  * 4: Use 'AMD_pinned_memory' extension.
+ * 5: Use Persistent and Coherent mapping ('ARB_buffer_storage'), with Fences synchronization.
+ * 6: Use Persistent mapping with Explicit flushing of the dirty ranges, with Fences synchronization.
+ * 7: Use one single Persistent and Coherent buffer, sub-allocated in slots as a ring.
+ * 8: Use glBufferSubData() to let the driver copy from a System Memory staging buffer.
+ * 9: Use Orphaning through the GL_MAP_INVALIDATE_BUFFER_BIT flag of glMapBufferRange().
+ * 10: Use Unsynchronized Buffer Update with Orphaning through glInvalidateBufferData().
+ * 11: Use Direct State Access ('ARB_direct_state_access') with an immutable texture and
+ *     Persistent and Coherent mapping, with Fences synchronization.
+ * 12: Use Persistent and Coherent mapping, copying each horizontal band to the texture
+ *     as soon as it has been written, with Fences synchronization.
+ * 13: Use Persistent and Coherent mapping, written and copied to the texture by a worker
+ *     thread with its own shared context; the render thread only draws. The threads
+ *     synchronize the GPU with glWaitSync().
  */
-enum PboMethod { NONE, ORPHAN, UNSYNCH_ORPHAN, UNSYNCH_FENCES, AMD };
+enum PboMethod { NONE, ORPHAN, UNSYNCH_ORPHAN, UNSYNCH_FENCES, AMD, PERSISTENT_COHERENT, PERSISTENT_FLUSH,
+                 PERSISTENT_RING, BUFFER_SUBDATA, MAP_INVALIDATE, INVALIDATE_DATA, DSA, BANDED, SHARED_CONTEXT,
+                 PBO_METHOD_COUNT };
 PboMethod pboMethod = NONE;
+void setPboMethod(PboMethod method, int count);
+bool isPboMethodSupported(PboMethod method);
+bool isPboMethodFenced(PboMethod method);
+bool isPboMethodMapped(PboMethod method);
+bool isPboMethodDiscarding(PboMethod method);
+const char* getPboMethodName(PboMethod method);
+
+// Producer thread: frames are written by a separate thread, as they would be
+// by a capture thread, into slots that are persistently mapped or pinned.
+// Slot indices are handed over in both directions through lock-free queues;
+// the GL thread only issues the copies and the fences.
+bool producerEnabled = false;           // toggled with 'p'
+bool producerRunning = false;           // false if the PBO method has no persistent pointers
+std::thread producerThread;
+std::atomic<bool> producerStop(false);
+SpscQueue<int> filledSlots(16);         // producer -> GL thread: slots ready to be copied
+SpscQueue<int> freeSlots(16);           // GL thread -> producer: slots the GPU is done with
+std::deque<int> pendingSlots;           // slots whose copy is still fenced (GL thread only)
+std::vector<float> slotUpdateTimes;     // time spent by the producer writing each slot
+
+// Upload worker thread of the SHARED_CONTEXT method: it owns the PBOs and
+// copies them to the textures in a second context sharing the GLUT one.
+// Textures travel between the threads with the fence of the last GPU command
+// using them (copy or draw), which the receiver waits for with glWaitSync().
+struct TextureHandoff { int textureIdx; GLsync fence; float updateTime, copyTime; };
+bool sharedContextSupported = false;
+SharedContext uploadContext;
+bool uploadWorkerRunning = false;
+std::thread uploadWorkerThread;
+std::atomic<bool> uploadWorkerStop(false);
+std::atomic<bool> uploadWorkerAlive(false);      // false once the worker has returned
+SpscQueue<TextureHandoff> readyTextures(16);     // worker -> render thread: textures to draw
+SpscQueue<TextureHandoff> drawnTextures(16);     // render thread -> worker: textures to fill
+
+/* Pixel update patterns:
+ * 0: The whole frame changes every time.
+ * 1: Only a scrolling strip of rows changes, the rest of the frame is static.
+ * 2: Only a few small rectangles change, like a screen capture source.
+ */
+enum UpdatePattern { UPDATE_FULL, UPDATE_PARTIAL, UPDATE_RECTS, UPDATE_PATTERN_COUNT };
+UpdatePattern updatePattern = UPDATE_FULL;
+const int PARTIAL_UPDATE_DIVISOR = 8; // UPDATE_PARTIAL writes 1/8 of the rows
+const int DIRTY_RECT_COUNT = 8;       // UPDATE_RECTS writes 8 rectangles...
+const int DIRTY_RECT_SIZE = 256;      // ...of 256x256 pixels (3% of a 4096x4096 frame)
+
+// Area of the frame written by the last call to updatePixels()
+// Only these areas are copied from the PBO to the texture.
+struct DirtyRect { int x, y, width, height; };
+std::vector<DirtyRect> dirtyRects;
+std::vector<std::vector<DirtyRect> > pboDirtyRects; // Areas written in each PBO
+std::vector<DirtyRect> fullFrameRects(1); // See getCopyRects(), global so it outlives exitCB()
+struct ByteRange { GLintptr offset; GLsizeiptr length; };
+std::vector<ByteRange> dirtyRanges;     // Bytes of the frame covered by dirtyRects, see getDirtyRanges()
+void getDirtyRanges(const std::vector<DirtyRect>& rects, std::vector<ByteRange>& ranges);
+const std::vector<DirtyRect>& getCopyRects(const std::vector<DirtyRect>& rects);
+void copyPixelRects(const std::vector<DirtyRect>& rects, const GLubyte* pixels, int firstRow, int rowCount);
 
 // Function pointers for PBO Extension ////////////////////////////////////////
 // Windows needs to get function pointers from ICD OpenGL drivers,
@@ -167,29 +557,70 @@ PFNGLUNMAPBUFFERARBPROC pglUnmapBufferARB = 0;                   // unmap VBO pr
 
 int main(int argc, char **argv)
 {
+    if (!parseArguments(argc, argv))
+        return 1;
+
+    // Matrix records written to the standard output must be the only lines
+    // there, so that they can be parsed: the messages go to the standard error
+    if (matrixMode && matrixOutput.empty()) {
+        matrixStdout = cout.rdbuf(std::cerr.rdbuf());
+    }
+
+    // Before any thread or buffer is created, so that they all inherit it
+    if (numaNode >= 0) {
+        int nodeCount = getNumaNodeCount();
+        if (numaNode >= nodeCount) {
+            cout << "ERROR [main]: NUMA node " << numaNode << " does not exist (" << nodeCount
+                 << " node(s)), running without binding" << endl;
+            numaNode = -1;
+        }
+        else if (setNumaNode(numaNode)) {
+            cout << "Bound the threads and the system memory buffers to NUMA node " << numaNode
+                 << " (" << nodeCount << " node(s))" << endl;
+        }
+        else {
+            cout << "Could NOT bind all the threads and allocations to NUMA node " << numaNode << endl;
+        }
+    }
+
+    // dTLB misses of this thread, which draws the frames and runs the driver, and
+    // of all the threads started from now on: fill, producer, upload worker and
+    // driver threads
+    memoryCountersOpen = openMemoryCounters();
+
+    setStagingPoolEnabled(stagingPoolEnabled);
     initSharedMem();
 
     // register exit callback
     atexit(exitCB);
 
-    // init GLUT and GL
-    initGLUT(argc, argv);
+    // the upload worker thread uses the window system too
+    SharedContext::initThreads();
+
+    // init GLUT (or EGL without any window) and GL
+    if (headless) {
+        if (!initEGL())
+            return 1;
+    }
+    else {
+        initGLUT(argc, argv);
+    }
     initGL();
+    if (headless) {
+        reshapeCB(SCREEN_WIDTH, SCREEN_HEIGHT); // No window to send the first reshape event
+    }
 
     // get OpenGL info
     glInfo glInfo;
     glInfo.getInfo();
     //glInfo.printSelf();
 
-    // init 2 texture objects
-    glGenTextures(1, &textureId);
-    glBindTexture(GL_TEXTURE_2D, textureId);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, IMAGE_WIDTH, IMAGE_HEIGHT, 0, PIXEL_FORMAT, GL_UNSIGNED_BYTE, (GLvoid*)imageData);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    // --size was parsed before any GL context could tell the largest texture
+    if (!checkMaxTextureSize(imageWidth, imageHeight))
+        return 1;
+
+    // init texture object
+    initTexture();
 
 #if defined(_WIN32)
     // check PBO is supported by your video card
@@ -245,14 +676,78 @@ int main(int argc, char **argv)
         cout << "Video card does NOT support GL_AMD_pinned_memory" << endl;
     }
 
+    if (glInfo.isExtensionSupported("GL_ARB_buffer_storage")) {
+        storageSupported = true;
+        cout << "Video card supports GL_ARB_buffer_storage" << endl;
+    }
+    else {
+        cout << "Video card does NOT support GL_ARB_buffer_storage" << endl;
+    }
+
+    if (glInfo.isExtensionSupported("GL_ARB_invalidate_subdata")) {
+        invalidateSupported = true;
+        cout << "Video card supports GL_ARB_invalidate_subdata" << endl;
+    }
+    else {
+        cout << "Video card does NOT support GL_ARB_invalidate_subdata" << endl;
+    }
+
+    if (glInfo.isExtensionSupported("GL_ARB_direct_state_access")) {
+        dsaSupported = true;
+        cout << "Video card supports GL_ARB_direct_state_access" << endl;
+    }
+    else {
+        cout << "Video card does NOT support GL_ARB_direct_state_access" << endl;
+    }
+
+    if (glInfo.isExtensionSupported("GL_ARB_timer_query")) {
+        timerQuerySupported = true;
+        cout << "Video card supports GL_ARB_timer_query" << endl;
+    }
+    else {
+        cout << "Video card does NOT support GL_ARB_timer_query" << endl;
+    }
+
     // Query the system memory page size and update the default value
     if (sysconf(_SC_PAGE_SIZE) > 0) {
         systemPageSize = sysconf(_SC_PAGE_SIZE);
     }
 #endif
 
+    // second context, sharing the objects of the GLUT one, for the SHARED_CONTEXT method
+    if (uploadContext.create()) {
+        sharedContextSupported = true;
+        cout << "Created a shared GL context for the upload worker thread" << endl;
+    }
+    else {
+        cout << "Could NOT create a shared GL context for the upload worker thread" << endl;
+    }
+
+    initGpuTimers();
+
+    for (int i = FILL_SSE2; i < FILL_KERNEL_COUNT; ++i) {
+        cout << "CPU " << (isFillKernelSupported((FillKernel)i) ? "supports " : "does NOT support ")
+             << getFillKernelName((FillKernel)i) << " fill" << endl;
+    }
+    if (!fillKernelSet) {
+        fillKernel = getBestFillKernel();
+    }
+    else if (!isFillKernelSupported(fillKernel)) {
+        cout << "ERROR [main]: " << getFillKernelName(fillKernel) << " fill is not supported" << endl;
+        return 1;
+    }
+    cout << "Fill kernel: " << getFillKernelName(fillKernel) << endl;
+
+    int hardwareThreads = (int)std::thread::hardware_concurrency();
+    setFillThreadCount(fillThreadCount);
+    cout << "Fill threads: " << fillThreadCount << " (" << hardwareThreads << " hardware threads)" << endl;
+
     cout << "System memory page size: " << systemPageSize << " bytes" << endl;
-    cout << "Texture data size: " << DATA_SIZE << " bytes" << endl;
+    if (memoryCountersOpen)
+        cout << "Counting the dTLB misses of the GL, fill, producer, upload worker and driver threads" << endl;
+    else
+        cout << "Could NOT count the dTLB misses (perf events not available or not permitted)" << endl;
+    cout << "Texture data size: " << dataSize << " bytes" << endl;
 
     // Moved to setPboCount()
     //    if (pboSupported)
@@ -261,15 +756,35 @@ int main(int argc, char **argv)
     //        // glBufferDataARB with NULL pointer reserves only memory space.
     //        glGenBuffersARB(2, pboIds);
     //        glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, pboIds[0]);
-    //        glBufferDataARB(GL_PIXEL_UNPACK_BUFFER_ARB, DATA_SIZE, 0, GL_STREAM_DRAW_ARB);
+    //        glBufferDataARB(GL_PIXEL_UNPACK_BUFFER_ARB, dataSize, 0, GL_STREAM_DRAW_ARB);
     //        glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, pboIds[1]);
-    //        glBufferDataARB(GL_PIXEL_UNPACK_BUFFER_ARB, DATA_SIZE, 0, GL_STREAM_DRAW_ARB);
+    //        glBufferDataARB(GL_PIXEL_UNPACK_BUFFER_ARB, dataSize, 0, GL_STREAM_DRAW_ARB);
     //        glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
     //    }
 
+    if (startMethod >= 0) {
+        if (!isPboMethodSupported((PboMethod)startMethod)) {
+            cout << "ERROR [main]: PBO method " << startMethod << " ("
+                 << getPboMethodName((PboMethod)startMethod) << ") is not supported" << endl;
+            return 1;
+        }
+        setPboMethod((PboMethod)startMethod, startPboCount);
+    }
+    else if (calibrationEnabled && !matrixMode) {
+        runCalibration();
+    }
+
     // start timer, the elapsed time will be used for updateVertices()
     timer.start();
 
+    if (headless) {
+        if (matrixMode)
+            runMatrix();
+        else
+            runHeadless();
+        return 0;
+    }
+
     // the last GLUT call (LOOP)
     // window will be shown and display callback is triggered by events
     // NOTE: this call never return main().
@@ -285,23 +800,166 @@ int main(int argc, char **argv)
 
 void displayCB()
 {
+    static Timer frameTimer;
+    static bool frameTimerStarted = false;
+    frameTimer.stop();
+    frameTime = frameTimerStarted ? (float)frameTimer.getElapsedTimeInMilliSec() : 0;
+    frameTimer.start();
+    frameTimerStarted = true;
+
+    /*
+     * Update texture indices used in copy & draw.
+     *
+     * When (textureCount > 1), the texture that receives the new pixels is not
+     * the one being drawn, so the copy does not have to wait for the previous
+     * draw to finish sampling it. The texture drawn is the one that received
+     * the pixels in the previous frame.
+     */
+    copyTextureIdx = (copyTextureIdx + 1) % textureCount;
+    drawTextureIdx = (textureCount > 1) ? (copyTextureIdx + textureCount - 1) % textureCount : copyTextureIdx;
+    bool handBackTexture = false; // SHARED_CONTEXT: the drawn texture goes back to the worker thread
+
+    collectGpuTimers(false); // Read back the GPU times of previous frames
+
     if (pboMethod == NONE) {
         /*
          * Update data in System Memory.
          */
         t1.start();
-        updatePixels(imageData, DATA_SIZE);
+        updatePixels(imageData, dataSize);
         t1.stop();
         updateTime = t1.getElapsedTimeInMilliSec();
 
         /*
          * Copy data from System Memory to texture object.
          */
+        waitTextureFence(copyTextureIdx); // Reported with the texture fences, not in the copy time
+        t1.start();
+        glBindTexture(GL_TEXTURE_2D, textureIds[copyTextureIdx]);
+        beginGpuTimer();
+        copyPixelRects(getCopyRects(dirtyRects), imageData, 0, imageHeight);
+        endGpuTimer();
+        t1.stop();
+        copyTime = t1.getElapsedTimeInMilliSec();
+    }
+    else if (producerRunning) {
+        /*
+         * Copy the next frame written by the producer thread.
+         *
+         * The producer fills free slots through their persistent mappings and
+         * pushes them to "filledSlots". Here we only copy them to the texture
+         * and fence them; a slot goes back to "freeSlots" once its fence has
+         * signaled, so the producer never writes a slot the GPU is reading.
+         */
+        int slot;
+        t1.start();
+        recycleSlots(false);
+        while (!filledSlots.pop(slot)) {
+            if (!pendingSlots.empty())
+                recycleSlots(true); // The producer may be out of free slots
+            else
+                std::this_thread::yield();
+        }
+        t1.stop();
+        waitTime = t1.getElapsedTimeInMilliSec();
+        updateTime = slotUpdateTimes[slot];
+
+        waitTextureFence(copyTextureIdx); // Reported with the texture fences, not in the copy time
+        t1.start();
+        if (pboMethod != DSA) {
+            glBindTexture(GL_TEXTURE_2D, textureIds[copyTextureIdx]);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, getPboId(slot));
+        beginGpuTimer();
+        copyPixelRects(getCopyRects(pboDirtyRects[slot]), (GLubyte*)getPboOffset(slot), 0, imageHeight);
+        endGpuTimer();
+
+        glDeleteSync(pboFences[slot]);
+        pboFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        pendingSlots.push_back(slot);
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        t1.stop();
+        copyTime = t1.getElapsedTimeInMilliSec();
+    }
+    else if (pboMethod == SHARED_CONTEXT) {
+        /*
+         * Draw the next texture uploaded by the worker thread.
+         *
+         * The worker writes the PBOs and copies them to the textures in its
+         * own context. Each texture arrives with the fence of its copy:
+         * glWaitSync() makes the GPU wait for it, this thread does not block.
+         */
+        TextureHandoff item;
+        bool received = false;
+        t1.start();
+        while (uploadWorkerRunning && !(received = readyTextures.pop(item))) {
+            if (!uploadWorkerAlive)
+                break; // The worker could not start, keep drawing the last texture
+            std::this_thread::yield();
+        }
+        t1.stop();
+        waitTime = t1.getElapsedTimeInMilliSec();
+
+        if (received) {
+            glWaitSync(item.fence, 0, GL_TIMEOUT_IGNORED);
+            glDeleteSync(item.fence);
+            drawTextureIdx = item.textureIdx;
+            updateTime = item.updateTime;
+            copyTime = item.copyTime;
+            handBackTexture = true;
+        }
+    }
+    else if (pboMethod == BANDED) {
+        /*
+         * Write and copy the frame in horizontal bands.
+         *
+         * Each band is copied to the texture as soon as it has been written,
+         * so the GPU copy of one band overlaps the CPU generation of the next.
+         * The same PBO is written and copied within the frame; pboCount > 1
+         * lets the next frame start before the copies of this one are done.
+         */
+        static int slotIdx = 0;
+        slotIdx = (slotIdx + 1) % pboCount;
+        int rowsPerBand = (imageHeight + bandCount - 1) / bandCount;
+
+        t1.start();
+        waitPboFence(slotIdx);
+        beginPixelUpdate();
+        t1.stop();
+        updateTime = t1.getElapsedTimeInMilliSec();
+
+        waitTextureFence(copyTextureIdx); // Reported with the texture fences, not in the copy time
         t1.start();
-        glBindTexture(GL_TEXTURE_2D, textureId);
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, IMAGE_WIDTH, IMAGE_HEIGHT, PIXEL_FORMAT, GL_UNSIGNED_BYTE, (GLvoid*)imageData);
+        glBindTexture(GL_TEXTURE_2D, textureIds[copyTextureIdx]);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pboIds[slotIdx]);
         t1.stop();
         copyTime = t1.getElapsedTimeInMilliSec();
+
+        for (int row = 0; row < imageHeight; row += rowsPerBand) {
+            int rowCount = (row + rowsPerBand <= imageHeight) ? rowsPerBand : imageHeight - row;
+
+            t1.start();
+            updatePixelRows(pboPointers[slotIdx], row, rowCount); // Update data directly on the mapped buffer
+            t1.stop();
+            updateTime += t1.getElapsedTimeInMilliSec();
+
+            // Coherent mapping: the band is already visible to the GL.
+            // glFlush() makes the GPU start the copy while the next band is written.
+            t1.start();
+            beginGpuTimer();
+            copyPixelRects(getCopyRects(dirtyRects), NULL, row, rowCount);
+            endGpuTimer();
+            glFlush();
+            t1.stop();
+            copyTime += t1.getElapsedTimeInMilliSec();
+        }
+        endPixelUpdate();
+
+        glDeleteSync(pboFences[slotIdx]);
+        pboFences[slotIdx] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
     }
     else {
         /*
@@ -324,10 +982,12 @@ void displayCB()
          */
         t1.start();
 
-        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pboIds[uploadIdx]); // Access the Pixel Buffer Object and bind it
+        if (pboMethod != DSA) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, getPboId(uploadIdx)); // Access the Pixel Buffer Object and bind it
+        }
 
         if (pboMethod == ORPHAN) {
-            glBufferDataARB(GL_PIXEL_UNPACK_BUFFER_ARB, DATA_SIZE, NULL, GL_STREAM_DRAW_ARB);
+            glBufferDataARB(GL_PIXEL_UNPACK_BUFFER_ARB, dataSize, NULL, GL_STREAM_DRAW_ARB);
             GLubyte* ptr = (GLubyte*)glMapBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, GL_WRITE_ONLY_ARB);
             if (NULL == ptr) {
                 cout << "ERROR [displayCB] (glMapBufferARB): " << (char*)gluErrorString(glGetError()) << endl;
@@ -335,111 +995,121 @@ void displayCB()
             }
             else {
                 // update data directly on the mapped buffer
-                updatePixels(ptr, DATA_SIZE);
+                updatePixels(ptr, dataSize);
                 // release pointer to mapping buffer
                 if (!glUnmapBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB)) {
                     cout << "ERROR [displayCB] (glUnmapBufferARB): " << (char*)gluErrorString(glGetError()) << endl;
                 }
             }
         }
-        else if (pboMethod == UNSYNCH_ORPHAN || pboMethod == UNSYNCH_FENCES) {
+        else if (pboMethod == UNSYNCH_ORPHAN || pboMethod == UNSYNCH_FENCES
+                || pboMethod == MAP_INVALIDATE || pboMethod == INVALIDATE_DATA) {
+            GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
             if (pboMethod == UNSYNCH_FENCES) {
-                if (glIsSync(pboFences[uploadIdx])) {
-                    GLenum result = glClientWaitSync(pboFences[uploadIdx], 0, GL_TIMEOUT_IGNORED);
-                    switch (result) {
-                    case GL_ALREADY_SIGNALED:
-                        // Transfer was already done when trying to use buffer
-                        //cout << "DEBUG (glClientWaitSync): ALREADY_SIGNALED (good timing!) uploadIdx: " << uploadIdx << endl;
-                        break;
-                    case GL_CONDITION_SATISFIED:
-                        // This means that we had to wait for the fence to synchronize us after using all the buffers,
-                        // which implies that the GPU command queue is full and that we are GPU-bound (DMA transfers aren't fast enough).
-                        //cout << "WARNING (glClientWaitSync): CONDITION_SATISFIED (had to wait for the sync) uploadIdx: " << uploadIdx << endl;
-                        break;
-                    case GL_TIMEOUT_EXPIRED:
-                        cout << "WARNING (glClientWaitSync): TIMEOUT_EXPIRED (DMA transfers are too slow!) uploadIdx: " << uploadIdx << endl;
-                        break;
-                    case GL_WAIT_FAILED:
-                        cout << "ERROR (glClientWaitSync): WAIT_FAILED: " << (char*)gluErrorString(glGetError()) << endl;
-                        break;
-                    }
-                    glDeleteSync(pboFences[uploadIdx]); pboFences[uploadIdx] = NULL;
-                }
+                waitPboFence(uploadIdx);
             }
             else if (pboMethod == UNSYNCH_ORPHAN) {
-                glBufferData(GL_PIXEL_UNPACK_BUFFER, DATA_SIZE, NULL, GL_STREAM_DRAW); // Buffer re-specification (orphaning)
+                glBufferData(GL_PIXEL_UNPACK_BUFFER, dataSize, NULL, GL_STREAM_DRAW); // Buffer re-specification (orphaning)
             }
-            GLubyte* ptr = (GLubyte*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, DATA_SIZE, GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+            else if (pboMethod == MAP_INVALIDATE) {
+                access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT; // Orphaning without re-specifying the buffer
+            }
+            else if (pboMethod == INVALIDATE_DATA) {
+                glInvalidateBufferData(getPboId(uploadIdx)); // Orphaning without re-specifying the buffer
+            }
+            GLubyte* ptr = (GLubyte*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, dataSize, access);
             if (NULL == ptr) {
                 cout << "ERROR [displayCB] (glMapBufferRange): " << (char*)gluErrorString(glGetError()) << endl;
                 return;
             }
             else {
-                updatePixels(ptr, DATA_SIZE); // Update data directly on the mapped buffer
+                updatePixels(ptr, dataSize); // Update data directly on the mapped buffer
                 if (!glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER)) {
                     cout << "ERROR [displayCB] (glUnmapBuffer): " << (char*)gluErrorString(glGetError()) << endl;
                 }
             }
         }
         else if (pboMethod == AMD) {
-            if (glIsSync(pboFences[uploadIdx])) {
-                GLenum result = glClientWaitSync(pboFences[uploadIdx], 0, GL_TIMEOUT_IGNORED);
-                switch (result) {
-                case GL_ALREADY_SIGNALED:
-                    // Transfer was already done when trying to use buffer
-                    //cout << "DEBUG (glClientWaitSync): ALREADY_SIGNALED (good timing!) uploadIdx: " << uploadIdx << endl;
-                    break;
-                case GL_CONDITION_SATISFIED:
-                    // This means that we had to wait for the fence to synchronize us after using all the buffers,
-                    // which implies that the GPU command queue is full and that we are GPU-bound (DMA transfers aren't fast enough).
-                    //cout << "WARNING (glClientWaitSync): CONDITION_SATISFIED (had to wait for the sync) uploadIdx: " << uploadIdx << endl;
-                    break;
-                case GL_TIMEOUT_EXPIRED:
-                    cout << "WARNING (glClientWaitSync): TIMEOUT_EXPIRED (DMA transfers are too slow!) uploadIdx: " << uploadIdx << endl;
-                    break;
-                case GL_WAIT_FAILED:
-                    cout << "ERROR (glClientWaitSync): WAIT_FAILED: " << (char*)gluErrorString(glGetError()) << endl;
-                    break;
-                }
-                glDeleteSync(pboFences[uploadIdx]); pboFences[uploadIdx] = NULL;
+            waitPboFence(uploadIdx);
+            updatePixels(alignedBuffers[uploadIdx], dataSize); // Update data directly on the mapped buffer
+        }
+        else if (pboMethod == PERSISTENT_COHERENT || pboMethod == PERSISTENT_RING || pboMethod == DSA) {
+            // The buffer was mapped once in setPboCount(), no map/unmap per frame.
+            // Coherent mapping: writes become visible to the GL without any explicit flush.
+            waitPboFence(uploadIdx);
+            updatePixels(pboPointers[uploadIdx], dataSize); // Update data directly on the mapped buffer
+        }
+        else if (pboMethod == PERSISTENT_FLUSH) {
+            waitPboFence(uploadIdx);
+            updatePixels(pboPointers[uploadIdx], dataSize); // Update data directly on the mapped buffer
+
+            // Tell the GL exactly which bytes were written; the rest of the buffer is left untouched
+            getDirtyRanges(dirtyRects, dirtyRanges);
+            for (size_t i = 0; i < dirtyRanges.size(); ++i) {
+                glFlushMappedBufferRange(GL_PIXEL_UNPACK_BUFFER, dirtyRanges[i].offset, dirtyRanges[i].length);
+                flushedBytes += dirtyRanges[i].length;
+            }
+        }
+        else if (pboMethod == BUFFER_SUBDATA) {
+            // Baseline without mapping: fill the reusable staging buffer in
+            // System Memory and let the driver copy the written areas into the PBO
+            updatePixels(imageData, dataSize);
+            getDirtyRanges(dirtyRects, dirtyRanges);
+            for (size_t i = 0; i < dirtyRanges.size(); ++i) {
+                const ByteRange& range = dirtyRanges[i];
+                glBufferSubData(GL_PIXEL_UNPACK_BUFFER, range.offset, range.length, imageData + range.offset);
             }
-            updatePixels(alignedBuffers[uploadIdx], DATA_SIZE); // Update data directly on the mapped buffer
         }
 
+        pboDirtyRects[uploadIdx] = dirtyRects; // Remember what has to be copied from this PBO
+
         t1.stop();
         updateTime = t1.getElapsedTimeInMilliSec();
 
-        /*
-         * Protect each Pixel Buffer Object against being overwritten.
-         *
-         * Tipically the data upload will be slower than our main loop, so this
-         * function will be called again before the previous frame was uploaded
-         * and processed. The main bottleneck is the PCI bus transfer speed,
-         * which limits how fast the DMA (System Memory --> VRAM) can work.
-         *
-         * OpenGL Sync Fences will block until the PBO is released.
-         */
-        if (pboMethod == UNSYNCH_FENCES || pboMethod == AMD) {
-            pboFences[uploadIdx] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
-        }
-
         /*
          * Copy data from a Pixel Buffer Object to a GPU texture.
          * glTexSubImage2D() will copy pixels to the corresponding texture in the GPU.
+         * The wait for the texture is reported with the texture fences, not
+         * in the copy time.
          */
+        waitTextureFence(copyTextureIdx);
+
         t1.start();
 
-        glBindTexture(GL_TEXTURE_2D, textureId); // Bind the texture
-        glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, pboIds[copyIdx]); // Access the Pixel Buffer Object and bind it
+        if (pboMethod != DSA) {
+            // With DSA the texture is addressed by name, only the source PBO has to be bound
+            glBindTexture(GL_TEXTURE_2D, textureIds[copyTextureIdx]); // Bind the texture
+        }
+        glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, getPboId(copyIdx)); // Access the Pixel Buffer Object and bind it
 
         // Use offset instead of pointer
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, IMAGE_WIDTH, IMAGE_HEIGHT, PIXEL_FORMAT, GL_UNSIGNED_BYTE, 0);
+        beginGpuTimer();
+        copyPixelRects(getCopyRects(pboDirtyRects[copyIdx]), (GLubyte*)getPboOffset(copyIdx), 0, imageHeight);
+        endGpuTimer();
 
         t1.stop();
         copyTime = t1.getElapsedTimeInMilliSec();
 
+        /*
+         * Protect each Pixel Buffer Object against being overwritten.
+         *
+         * Tipically the data upload will be slower than our main loop, so this
+         * function will be called again before the previous frame was uploaded
+         * and processed. The main bottleneck is the PCI bus transfer speed,
+         * which limits how fast the DMA (System Memory --> VRAM) can work.
+         *
+         * The fence is inserted after the copy that reads from the PBO, so it
+         * only signals once the GPU is done with it.
+         * OpenGL Sync Fences will block until the PBO is released.
+         */
+        if (isPboMethodFenced(pboMethod)) {
+            glDeleteSync(pboFences[copyIdx]);
+            pboFences[copyIdx] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        }
+
         // it is good idea to release PBOs with ID 0 after use.
         // Once bound with 0, all pixel operations behave normal ways.
+        // (the bitmap font of showInfo() would be read from the PBO otherwise)
         glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
     }
 
@@ -455,7 +1125,7 @@ void displayCB()
     glRotatef(cameraAngleY, 0, 1, 0); // heading
 
     // draw a point with texture
-    glBindTexture(GL_TEXTURE_2D, textureId);
+    glBindTexture(GL_TEXTURE_2D, textureIds[drawTextureIdx]);
     glColor4f(1, 1, 1, 1);
     glBegin(GL_QUADS);
     glNormal3f(0, 0, 1);
@@ -468,14 +1138,32 @@ void displayCB()
     // unbind texture
     glBindTexture(GL_TEXTURE_2D, 0);
 
+    // protect the texture against being overwritten while it is still drawn
+    if (handBackTexture) {
+        TextureHandoff item = { drawTextureIdx, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0), 0, 0 };
+        glFlush(); // The fence must reach the GPU before the worker's context waits for it
+        drawnTextures.push(item);
+    }
+    else if (textureCount > 1) {
+        glDeleteSync(textureFences[drawTextureIdx]);
+        textureFences[drawTextureIdx] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
     // draw info messages
-    showInfo();
+    if (!headless) {
+        showInfo(); // The bitmap fonts come from GLUT
+    }
     //showTransferRate();
     printTransferRate();
 
     glPopMatrix();
 
-    glutSwapBuffers();
+    if (headless || calibrating)
+        glFlush(); // Nothing to present, only submit the frame
+    else
+        glutSwapBuffers();
+
+    applyAdaptivePboCount(); // Between two frames, as the PBO count keys
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -541,12 +1229,144 @@ void keyboardCB(unsigned char key, int x, int y)
         break;
 
     case ' ':
-        pboMethod = (PboMethod)(((int)pboMethod + 1) % (amdSupported ? 5 : 4));
-        cout << "PBO Method: " << pboMethod << endl;
-        setPboCount(1);
+    {
+        PboMethod method = pboMethod;
+        do {
+            method = (PboMethod)(((int)method + 1) % PBO_METHOD_COUNT);
+        } while (!isPboMethodSupported(method));
+        startReconfigure();
+        setPboMethod(method, 1);
+        stopReconfigure("PBO method");
+        resetAdaptivePboCount();
+        resetTransferRate();
+        break;
+    }
+
+    case 't': // switch amount of textures in the ring (1 -> 2 -> 3 -> 4)
+    case 'T':
+        textureCount = (textureCount % MAX_TEXTURE_COUNT) + 1;
+        cout << "Texture Count: " << textureCount << endl;
+        initTexture();
+        resetTransferRate();
+        break;
+
+    case 's': // switch frame sizes (1024x1024 -> 1080p -> 4K -> 4096x4096 -> 8K -> 8192x8192)
+    case 'S':
+    {
+        int idx = 0;
+        while (idx < FRAME_SIZE_COUNT && (FRAME_SIZES[idx][0] != imageWidth || FRAME_SIZES[idx][1] != imageHeight))
+            ++idx;
+        idx = (idx + 1) % FRAME_SIZE_COUNT; // A size given on the command line goes back to the first one
+        startReconfigure();
+        setImageFormat(FRAME_SIZES[idx][0], FRAME_SIZES[idx][1], pixelFormatIdx);
+        stopReconfigure("frame size");
+        resetAdaptivePboCount();
+        resetTransferRate();
+        break;
+    }
+
+    case 'f': // switch pixel formats (BGRA8 -> RGBA8 -> RGB8 -> R8 -> R16 -> RGBA16F)
+    case 'F':
+        startReconfigure();
+        setImageFormat(imageWidth, imageHeight, (pixelFormatIdx + 1) % PIXEL_FORMAT_COUNT);
+        stopReconfigure("pixel format");
+        resetAdaptivePboCount();
+        resetTransferRate();
+        break;
+
+    case 'k': // switch the kernels writing the pixels (scalar -> SSE2 -> AVX2)
+    case 'K':
+        stopProducer(); // The producer and upload worker threads write pixels
+        stopUploadWorker();
+        do {
+            fillKernel = (FillKernel)((fillKernel + 1) % FILL_KERNEL_COUNT);
+        } while (!isFillKernelSupported(fillKernel));
+        cout << "Fill kernel: " << getFillKernelName(fillKernel) << endl;
+        startProducer();
+        startUploadWorker();
         resetTransferRate();
         break;
 
+    case 'w': // switch amount of threads writing the pixels (1 -> 2 -> 4 -> ... -> hardware threads)
+    case 'W':
+    {
+        int maxCount = (int)std::thread::hardware_concurrency();
+        if (maxCount < 2)
+            maxCount = 2;
+        if (maxCount > MAX_FILL_THREADS)
+            maxCount = MAX_FILL_THREADS;
+        setFillThreadCount((fillThreadCount >= maxCount) ? 1 : (fillThreadCount * 2 < maxCount ? fillThreadCount * 2 : maxCount));
+        cout << "Fill threads: " << fillThreadCount << endl;
+        resetTransferRate();
+        break;
+    }
+
+    case 'h': // switch the pages of the system memory buffers (system -> transparent huge -> 2 MB -> 1 GB)
+    case 'H':
+        setHugePages((HugePages)((hugePages + 1) % HUGE_PAGES_COUNT));
+        cout << "Huge pages: " << getHugePagesName(hugePages) << endl;
+        resetTransferRate();
+        break;
+
+    case 'l': // switch pre-faulting and locking the staging buffers on/off
+    case 'L':
+        prefaultEnabled = !prefaultEnabled;
+        cout << "Pre-fault and lock staging buffers: " << (prefaultEnabled ? "on" : "off") << endl;
+        reallocateBuffers();
+        resetTransferRate();
+        break;
+
+    case 'o': // switch the staging buffer pool on/off
+    case 'O':
+        setStagingPoolEnabled(!stagingPoolEnabled);
+        cout << "Staging buffer pool: ";
+        if (stagingPoolEnabled)
+            cout << "on (" << stagingPoolMB << " MB)" << endl;
+        else
+            cout << "off" << endl;
+        break;
+
+    case 'b': // switch amount of bands used by the BANDED method (1 -> 2 -> 4 -> ... -> 16)
+    case 'B':
+        bandCount = (bandCount >= MAX_BAND_COUNT) ? 1 : bandCount * 2;
+        cout << "Band Count: " << bandCount << endl;
+        resetTransferRate();
+        break;
+
+    case 'u': // switch pixel update patterns (full frame -> partial -> rectangles)
+    case 'U':
+        stopProducer(); // The producer and upload worker threads read the pattern
+        stopUploadWorker();
+        updatePattern = (UpdatePattern)(((int)updatePattern + 1) % UPDATE_PATTERN_COUNT);
+        startProducer();
+        startUploadWorker();
+        resetAdaptivePboCount(); // Another workload
+        resetTransferRate();
+        break;
+
+    case 'p': // switch the producer thread on/off
+    case 'P':
+        producerEnabled = !producerEnabled;
+        if (producerEnabled) {
+            startProducer();
+            if (!producerRunning)
+                cout << "Producer thread needs a persistently mapped or pinned PBO method" << endl;
+        }
+        else {
+            stopProducer();
+        }
+        resetTransferRate();
+        break;
+
+    case 'a': // switch the adaptive PBO count on/off
+    case 'A':
+        adaptivePboCount = !adaptivePboCount;
+        resetAdaptivePboCount();
+        cout << "Adaptive PBO count: " << (adaptivePboCount ? "on" : "off") << endl;
+        if (adaptivePboCount && !isPboMethodFenced(pboMethod))
+            cout << "Adaptive PBO count needs a fenced PBO method" << endl;
+        break;
+
     case 'd': // switch rendering modes (fill -> wire -> point)
     case 'D':
         drawMode = (drawMode + 1) % 3;
@@ -573,7 +1393,13 @@ void keyboardCB(unsigned char key, int x, int y)
     }
 
     if (key >= '0' && key <= '9') {
+        if (adaptivePboCount) {
+            adaptivePboCount = false; // The count is set by hand
+            cout << "Adaptive PBO count: off" << endl;
+        }
+        startReconfigure();
         setPboCount((int)key - (int)'0');
+        stopReconfigure("PBO count");
         resetTransferRate();
     }
 }
@@ -625,7 +1451,11 @@ void mouseMotionCB(int x, int y)
 
 void exitCB()
 {
+    if (!headless)
+        printLatencySummary();
+    fillPool.stop();
     clearSharedMem();
+    closeMemoryCounters();
 }
 
 
@@ -661,6 +1491,204 @@ void initGL()
     //@initLights();
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// (re)create the ring of 'textureCount' texture objects
+// The DSA method uses immutable storage, so the driver never has to check the
+// textures for completeness or reallocate them; all the others keep the
+// classic mutable glTexImage2D() storage.
+///////////////////////////////////////////////////////////////////////////////
+void clearTextures()
+{
+    stopUploadWorker(); // The upload worker thread writes to the textures
+
+    for (size_t i = 0; i < textureIds.size(); ++i) {
+        glDeleteSync(textureFences[i]);
+        glDeleteTextures(1, &textureIds[i]);
+    }
+    textureIds.clear();
+    textureFences.clear();
+}
+
+void initTexture()
+{
+    clearTextures();
+
+    for (int i = 0; i < textureCount; ++i) {
+        GLuint textureId;
+        if (pboMethod == DSA) {
+            glCreateTextures(GL_TEXTURE_2D, 1, &textureId);
+            glTextureParameteri(textureId, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTextureParameteri(textureId, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTextureParameteri(textureId, GL_TEXTURE_WRAP_S, GL_CLAMP);
+            glTextureParameteri(textureId, GL_TEXTURE_WRAP_T, GL_CLAMP);
+            glTextureStorage2D(textureId, 1, textureFormat, imageWidth, imageHeight);
+            textureImmutable = true;
+        }
+        else {
+            glGenTextures(1, &textureId);
+            glBindTexture(GL_TEXTURE_2D, textureId);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // Rows are tightly packed, e.g. RGB8
+            glTexImage2D(GL_TEXTURE_2D, 0, textureFormat, imageWidth, imageHeight, 0, pixelFormat, pixelType, (GLvoid*)imageData);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            textureImmutable = false;
+        }
+        textureIds.push_back(textureId);
+        textureFences.push_back(NULL);
+    }
+    copyTextureIdx = drawTextureIdx = 0;
+
+    startUploadWorker();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// set the frame geometry, without reallocating anything
+// It fails if a frame would not fit in an int, the type of the buffer sizes.
+///////////////////////////////////////////////////////////////////////////////
+bool initImageFormat(int width, int height, int formatIdx)
+{
+    if (width < 1 || height < 1 || formatIdx < 0 || formatIdx >= PIXEL_FORMAT_COUNT) {
+        cout << "ERROR [initImageFormat]: invalid frame " << width << "x" << height << endl;
+        return false;
+    }
+    const PixelFormat& format = PIXEL_FORMATS[formatIdx];
+    long long size = (long long)width * height * format.bytesPerPixel;
+    if (size > 0x7fffffff) {
+        cout << "ERROR [initImageFormat]: frame " << width << "x" << height << " " << format.name
+             << " is larger than 2 GB" << endl;
+        return false;
+    }
+
+    imageWidth = width;
+    imageHeight = height;
+    pixelFormatIdx = formatIdx;
+    pixelFormat = format.format;
+    pixelType = format.type;
+    textureFormat = format.internalFormat;
+    bytesPerPixel = format.bytesPerPixel;
+    dataSize = (int)size;
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// change the frame geometry at runtime
+// The textures, the PBOs and the system memory buffers are all reallocated,
+// with the same PBO method and count.
+///////////////////////////////////////////////////////////////////////////////
+bool setImageFormat(int width, int height, int formatIdx)
+{
+    if (width == imageWidth && height == imageHeight && formatIdx == pixelFormatIdx)
+        return true;
+
+    if (!checkMaxTextureSize(width, height))
+        return false;
+
+    int count = pboCount;
+    setPboCount(0);     // Also stops the producer and upload worker threads
+    clearTextures();
+    releaseImageData(); // While dataSize is still its size
+
+    int oldWidth = imageWidth, oldHeight = imageHeight, oldFormatIdx = pixelFormatIdx;
+    bool result = initImageFormat(width, height, formatIdx);
+    if (result && !allocImageData()) {
+        cout << "ERROR [setImageFormat]: cannot allocate the " << dataSize << " bytes of a "
+             << width << "x" << height << " frame, keeping the previous one" << endl;
+        result = false;
+    }
+    if (!result) {
+        initImageFormat(oldWidth, oldHeight, oldFormatIdx); // Rebuild the previous frame
+        allocImageData();
+    }
+    dirtyRects.clear();
+    partialRow = 0;
+
+    initTexture();
+    setPboCount(count);
+    cout << "Frame: " << imageWidth << "x" << imageHeight << " " << PIXEL_FORMATS[pixelFormatIdx].name
+         << ", " << dataSize << " bytes" << endl;
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// false if the GL cannot create a texture of width x height pixels
+///////////////////////////////////////////////////////////////////////////////
+bool checkMaxTextureSize(int width, int height)
+{
+    GLint maxTextureSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+    if (width > maxTextureSize || height > maxTextureSize) {
+        cout << "ERROR [checkMaxTextureSize]: frame " << width << "x" << height
+             << " is larger than GL_MAX_TEXTURE_SIZE (" << maxTextureSize << ")" << endl;
+        return false;
+    }
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// index of a pixel format in PIXEL_FORMATS from its name (any case), -1 if unknown
+///////////////////////////////////////////////////////////////////////////////
+int findPixelFormat(const std::string& name)
+{
+    std::string upper = name;
+    for (size_t i = 0; i < upper.size(); ++i)
+        upper[i] = (char)toupper((unsigned char)upper[i]);
+
+    for (int i = 0; i < PIXEL_FORMAT_COUNT; ++i) {
+        if (upper == PIXEL_FORMATS[i].name)
+            return i;
+    }
+    return -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FillKernel from its --fill name (any case), -1 if unknown
+///////////////////////////////////////////////////////////////////////////////
+int findFillKernel(const std::string& name)
+{
+    std::string lower = name;
+    for (size_t i = 0; i < lower.size(); ++i)
+        lower[i] = (char)tolower((unsigned char)lower[i]);
+
+    for (int i = 0; i < FILL_KERNEL_COUNT; ++i) {
+        if (lower == FILL_KERNEL_OPTIONS[i])
+            return i;
+    }
+    return -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HugePages from its --huge-pages name (any case), -1 if unknown
+///////////////////////////////////////////////////////////////////////////////
+int findHugePages(const std::string& name)
+{
+    std::string lower = name;
+    for (size_t i = 0; i < lower.size(); ++i)
+        lower[i] = (char)tolower((unsigned char)lower[i]);
+
+    for (int i = 0; i < HUGE_PAGES_COUNT; ++i) {
+        if (lower == HUGE_PAGES_OPTIONS[i])
+            return i;
+    }
+    return -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// parse a frame size, e.g. "1920x1080"
+///////////////////////////////////////////////////////////////////////////////
+bool parseSize(const std::string& text, int& width, int& height)
+{
+    char* end = NULL;
+    width = (int)strtol(text.c_str(), &end, 10);
+    if (*end != 'x' && *end != 'X')
+        return false;
+    height = (int)strtol(end + 1, &end, 10);
+    return *end == '\0' && width > 0 && height > 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // initialize GLUT for windowing
 ///////////////////////////////////////////////////////////////////////////////
@@ -696,11 +1724,766 @@ int initGLUT(int argc, char **argv)
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// initialize global variables
+// initialize EGL for the headless mode, instead of GLUT
+// It prefers Mesa's surfaceless platform, which needs no display server, and
+// a context without any surface that draws to a framebuffer object instead.
+// Without surfaceless contexts, it falls back to a pbuffer surface.
 ///////////////////////////////////////////////////////////////////////////////
-bool initSharedMem()
+bool initEGL()
 {
-    screenWidth = SCREEN_WIDTH;
+#if defined (__gnu_linux__)
+    EGLDisplay display = EGL_NO_DISPLAY;
+    const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (clientExtensions && strstr(clientExtensions, "EGL_MESA_platform_surfaceless") && getPlatformDisplay) {
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (display == EGL_NO_DISPLAY) {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+
+    EGLint major, minor;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+        cout << "ERROR [initEGL] (eglInitialize): 0x" << std::hex << eglGetError() << std::dec << endl;
+        return false;
+    }
+    cout << "EGL " << major << "." << minor << ": " << eglQueryString(display, EGL_VENDOR) << endl;
+
+    const char* extensions = eglQueryString(display, EGL_EXTENSIONS);
+    bool surfaceless = extensions && strstr(extensions, "EGL_KHR_surfaceless_context");
+
+    EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint configCount = 0;
+    if (!eglChooseConfig(display, configAttribs, &config, 1, &configCount) || configCount < 1) {
+        cout << "ERROR [initEGL] (eglChooseConfig): no config for desktop OpenGL" << endl;
+        return false;
+    }
+
+    eglBindAPI(EGL_OPENGL_API);
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+    if (context == EGL_NO_CONTEXT) {
+        cout << "ERROR [initEGL] (eglCreateContext): 0x" << std::hex << eglGetError() << std::dec << endl;
+        return false;
+    }
+
+    EGLSurface surface = EGL_NO_SURFACE;
+    if (!surfaceless) {
+        EGLint surfaceAttribs[] = { EGL_WIDTH, SCREEN_WIDTH, EGL_HEIGHT, SCREEN_HEIGHT, EGL_NONE };
+        surface = eglCreatePbufferSurface(display, config, surfaceAttribs);
+        if (surface == EGL_NO_SURFACE) {
+            cout << "ERROR [initEGL] (eglCreatePbufferSurface): 0x" << std::hex << eglGetError() << std::dec << endl;
+            return false;
+        }
+    }
+    if (!eglMakeCurrent(display, surface, surface, context)) {
+        cout << "ERROR [initEGL] (eglMakeCurrent): 0x" << std::hex << eglGetError() << std::dec << endl;
+        return false;
+    }
+
+    if (surfaceless) {
+        // No default framebuffer: draw to renderbuffers of the window size
+        GLuint renderbuffers[2];
+        glGenRenderbuffers(2, renderbuffers);
+        glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, SCREEN_WIDTH, SCREEN_HEIGHT);
+        glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, SCREEN_WIDTH, SCREEN_HEIGHT);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+        glGenFramebuffers(1, &headlessFbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, headlessFbo);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            cout << "ERROR [initEGL] (glCheckFramebufferStatus): incomplete framebuffer" << endl;
+            return false;
+        }
+    }
+
+    cout << "Headless " << (surfaceless ? "surfaceless" : "pbuffer") << " context: "
+         << (const char*)glGetString(GL_RENDERER) << endl;
+    return true;
+#else
+    cout << "ERROR [initEGL]: the headless mode needs EGL, only available on Linux" << endl;
+    return false;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// call displayCB() in a tight loop until the frame or time limit is reached
+// (a limit <= 0 is ignored), then wait for the GPU to finish the last frame
+///////////////////////////////////////////////////////////////////////////////
+RunResult runFrames(int frames, double seconds)
+{
+    Timer runTimer;
+    double updateTimeSum = 0;
+    double copyTimeSum = 0;
+    int frameCount = 0;
+    long long gpuNanoSecondsBegin = gpuCopyNanoSeconds;
+    long long gpuBytesBegin = gpuCopyBytes;
+    FenceWaits pboFenceWaitsBegin, textureFenceWaitsBegin;
+    readFenceCounters(pboFenceCounters, pboFenceWaitsBegin);
+    readFenceCounters(textureFenceCounters, textureFenceWaitsBegin);
+    MemoryCounters memoryBegin;
+    readMemoryCounters(memoryBegin);
+    runTimer.start();
+    RunResult result;
+    while ((frames <= 0 || frameCount < frames) &&
+           (seconds <= 0 || runTimer.getElapsedTime() < seconds)) {
+        displayCB();
+        updateTimeSum += updateTime;
+        copyTimeSum += copyTime;
+        result.updateHistogram.add(updateTime);
+        result.copyHistogram.add(copyTime);
+        if (frameCount > 0)
+            result.frameHistogram.add(frameTime); // The interval before the first frame is not part of the run
+        ++frameCount;
+    }
+    glFinish();
+    runTimer.stop();
+    collectGpuTimers(true);
+
+    result.frameCount = frameCount;
+    result.elapsedTime = runTimer.getElapsedTime();
+    result.updateTime = (frameCount > 0) ? updateTimeSum / frameCount : 0;
+    result.updateSpeedup = -1;
+    result.reconfigureTime = -1;
+    result.copyTime = (frameCount > 0) ? copyTimeSum / frameCount : 0;
+
+    long long gpuNanoSeconds = gpuCopyNanoSeconds - gpuNanoSecondsBegin;
+    result.gpuCopyTime = (gpuNanoSeconds > 0 && frameCount > 0) ? gpuNanoSeconds * 1e-6 / frameCount : -1;
+    result.gpuCopyRate = (gpuNanoSeconds > 0) ? (gpuCopyBytes - gpuBytesBegin) / (1024.0 * 1024) / (gpuNanoSeconds * 1e-9) : 0;
+
+    result.pboFenceWaits = getFenceWaitsSince(pboFenceCounters, pboFenceWaitsBegin);
+    result.textureFenceWaits = getFenceWaitsSince(textureFenceCounters, textureFenceWaitsBegin);
+
+    MemoryCounters memoryEnd;
+    readMemoryCounters(memoryEnd);
+    result.dtlbMisses = (memoryEnd.dtlbMisses >= 0 && frameCount > 0) ?
+                        (double)(memoryEnd.dtlbMisses - memoryBegin.dtlbMisses) / frameCount : -1;
+    result.pageFaults = (memoryEnd.minorFaults >= 0) ?
+                        (memoryEnd.minorFaults - memoryBegin.minorFaults) + (memoryEnd.majorFaults - memoryBegin.majorFaults) : -1;
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// run the current method for the frames or seconds of the command line,
+// then print the results of the whole run
+///////////////////////////////////////////////////////////////////////////////
+void runHeadless()
+{
+    cout << "Headless run: " << getPboMethodName(pboMethod) << ", " << pboCount << " PBO(s), ";
+    if (headlessFrames > 0)
+        cout << headlessFrames << " frame(s)" << endl;
+    else
+        cout << headlessSeconds << " second(s)" << endl;
+
+    RunResult result = runFrames(headlessFrames, headlessSeconds);
+
+    double frameRate = result.frameCount / result.elapsedTime;
+    cout << std::fixed << std::setprecision(1);
+    cout << getConfigLabel() << " Headless result: " << result.frameCount << " frames in "
+         << result.elapsedTime << " s -- Transfer Rate: " << frameRate * dataSize / (1024 * 1024)
+         << " MB/s @ " << frameRate << " FPS";
+    cout << std::setprecision(3);
+    cout << " -- Update: " << result.updateTime << " ms, Copy: " << result.copyTime << " ms";
+    if (result.gpuCopyTime >= 0) {
+        cout << " -- GPU Copy: " << result.gpuCopyTime << " ms, "
+             << std::setprecision(1) << result.gpuCopyRate << " MB/s";
+    }
+    printFenceWaits("PBO fences", result.pboFenceWaits, result.elapsedTime);
+    printFenceWaits("Texture fences", result.textureFenceWaits, result.elapsedTime);
+    if (result.dtlbMisses >= 0) {
+        cout << std::setprecision(1) << " -- dTLB misses: " << result.dtlbMisses / 1000 << " k/frame";
+    }
+    if (result.pageFaults >= 0) {
+        cout << " -- Page faults: " << result.pageFaults;
+    }
+    cout << std::resetiosflags(std::ios_base::fixed | std::ios_base::floatfield);
+    cout << endl;
+    printPagePlacement();
+
+    printPercentiles("Update", result.updateHistogram);
+    printPercentiles("Copy", result.copyHistogram);
+    printPercentiles("Frame", result.frameHistogram);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// time every supported method for a few frames, then select the fastest
+// The probe results are printed, so that the choice can be checked.
+// The frames are not presented: with the vertical sync, glutSwapBuffers()
+// would cap every method at the refresh rate of the display.
+///////////////////////////////////////////////////////////////////////////////
+void runCalibration()
+{
+    int count = startPboCountSet ? startPboCount : CALIBRATION_PBO_COUNT;
+    int frames = calibrationByP99 ? CALIBRATION_P99_FRAMES : CALIBRATION_FRAMES;
+    const char* frameTimeName = calibrationByP99 ? "p99" : "max"; // p99 of a dozen frames is their max
+    cout << "Calibration: " << frames << " frames per method, " << count
+         << " PBO(s), " << imageWidth << "x" << imageHeight << " " << PIXEL_FORMATS[pixelFormatIdx].name
+         << ", fastest by " << (calibrationByP99 ? "p99 frame time" : "throughput") << endl;
+
+    std::vector<PboMethod> methods;
+    std::vector<double> transferRates;
+    std::vector<double> frameTimes;     // p99 or max, see frameTimeName
+    calibrating = true;
+    for (int i = 0; i < PBO_METHOD_COUNT; ++i) {
+        PboMethod method = (PboMethod)i;
+        if (!isPboMethodSupported(method))
+            continue;
+
+        setPboMethod(method, (method == NONE) ? 0 : count);
+        resetTransferRate(); // No one-second report across methods
+        runFrames(CALIBRATION_WARMUP_FRAMES, 0);
+        RunResult result = runFrames(frames, 0);
+        methods.push_back(method);
+        transferRates.push_back(result.frameCount / result.elapsedTime * dataSize / (1024 * 1024));
+        frameTimes.push_back(calibrationByP99 ? result.frameHistogram.getPercentile(99) : result.frameHistogram.getMax());
+    }
+    calibrating = false;
+
+    size_t best = 0;
+    for (size_t i = 1; i < methods.size(); ++i) {
+        if (calibrationByP99 ? frameTimes[i] < frameTimes[best] : transferRates[i] > transferRates[best])
+            best = i;
+    }
+
+    cout << std::fixed << std::setprecision(1);
+    for (size_t i = 0; i < methods.size(); ++i) {
+        cout << ((i == best) ? "  * " : "    ") << std::setw(2) << (int)methods[i] << " "
+             << getPboMethodName(methods[i]) << ": " << transferRates[i] << " MB/s, "
+             << frameTimeName << ": " << frameTimes[i] << " ms" << endl;
+    }
+    cout << std::resetiosflags(std::ios_base::fixed | std::ios_base::floatfield);
+    cout << "Calibration selected: " << getPboMethodName(methods[best]) << endl;
+
+    setPboMethod(methods[best], (methods[best] == NONE) ? 0 : count);
+    resetTransferRate();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// sweep the benchmark matrix without any interaction
+// Unsupported methods are skipped. Each configuration is warmed up first, so
+// that buffer allocation and the first uploads are not measured.
+///////////////////////////////////////////////////////////////////////////////
+void runMatrix()
+{
+    std::vector<int> methods = matrixMethods;
+    if (methods.empty()) {
+        for (int i = 0; i < PBO_METHOD_COUNT; ++i)
+            methods.push_back(i);
+    }
+    std::vector<int> pboCounts = matrixPboCounts;
+    if (pboCounts.empty()) {
+        pboCounts.push_back(1);
+        pboCounts.push_back(2);
+        pboCounts.push_back(3);
+    }
+
+    std::ofstream file;
+    if (!matrixOutput.empty()) {
+        file.open(matrixOutput.c_str());
+        if (!file) {
+            cout << "ERROR [runMatrix]: cannot write " << matrixOutput << endl;
+            return;
+        }
+    }
+    std::ostream stdoutRecords(matrixStdout); // See main()
+    std::ostream& out = matrixOutput.empty() ? stdoutRecords : file;
+
+    if (!matrixJson) {
+        out << "method,method_name,pbo_count,texture_count,width,height,pixel_format,huge_pages,fill_kernel,fill_threads,"
+               "frames,seconds,fps,mb_per_s,update_ms,update_speedup,copy_ms,gpu_copy_ms,gpu_mb_per_s,"
+               "fence_waits,fence_signaled,fence_stalls,fence_failed,fence_stall_rate,fence_blocked_ms_per_s,"
+               "texture_fence_waits,texture_fence_stalls,texture_fence_blocked_ms_per_s,"
+               "dtlb_misses_per_frame,page_faults,reconfigure_ms,"
+               "update_p50_ms,update_p90_ms,update_p99_ms,update_p999_ms,update_max_ms,"
+               "copy_p50_ms,copy_p90_ms,copy_p99_ms,copy_p999_ms,copy_max_ms,"
+               "frame_p50_ms,frame_p90_ms,frame_p99_ms,frame_p999_ms,frame_max_ms" << endl;
+    }
+
+    std::vector<int> sizes = matrixSizes;
+    if (sizes.empty()) {
+        sizes.push_back(imageWidth);
+        sizes.push_back(imageHeight);
+    }
+    std::vector<int> formats = matrixFormats;
+    if (formats.empty()) {
+        formats.push_back(pixelFormatIdx);
+    }
+    std::vector<int> fillKernels;
+    for (size_t i = 0; i < matrixFillKernels.size(); ++i) {
+        if (isFillKernelSupported((FillKernel)matrixFillKernels[i]))
+            fillKernels.push_back(matrixFillKernels[i]);
+        else
+            cout << "Skipping unsupported fill kernel " << getFillKernelName((FillKernel)matrixFillKernels[i]) << endl;
+    }
+    if (matrixFillKernels.empty()) {
+        fillKernels.push_back(fillKernel);
+    }
+    std::vector<int> hugePageModes = matrixHugePages;
+    if (hugePageModes.empty()) {
+        hugePageModes.push_back(hugePages);
+    }
+    std::vector<int> fillThreads = matrixFillThreads;
+    if (fillThreads.empty()) {
+        fillThreads.push_back(fillThreadCount);
+    }
+
+    for (size_t s = 0; s < sizes.size(); s += 2) {
+        for (size_t f = 0; f < formats.size(); ++f) {
+            for (size_t h = 0; h < hugePageModes.size(); ++h) {
+                setPboMethod(NONE, 0); // Nothing to reallocate but the texture and imageData
+                if (!setImageFormat(sizes[s], sizes[s + 1], formats[f])) {
+                    cout << "Skipping unsupported frame " << sizes[s] << "x" << sizes[s + 1] << " "
+                         << PIXEL_FORMATS[formats[f]].name << endl;
+                    continue;
+                }
+                setHugePages((HugePages)hugePageModes[h]);
+
+                for (size_t i = 0; i < methods.size(); ++i) {
+                    PboMethod method = (PboMethod)methods[i];
+                    if (!isPboMethodSupported(method)) {
+                        if (s == 0 && f == 0 && h == 0)
+                            cout << "Skipping unsupported PBO method " << methods[i] << " (" << getPboMethodName(method) << ")" << endl;
+                        continue;
+                    }
+                    for (size_t j = 0; j < pboCounts.size(); ++j) {
+                        if (method == NONE && j > 0)
+                            break; // No PBO at all, a single configuration
+                        startReconfigure();
+                        setPboMethod(method, (method == NONE) ? 0 : pboCounts[j]);
+                        double reconfigureTime = stopReconfigure("PBO method");
+                        for (size_t k = 0; k < fillKernels.size(); ++k) {
+                            stopProducer(); // The producer and upload worker threads write pixels
+                            stopUploadWorker();
+                            fillKernel = (FillKernel)fillKernels[k];
+                            startProducer();
+                            startUploadWorker();
+                            double baseUpdateTime = 0; // with the first thread count, for the speedups
+                            for (size_t t = 0; t < fillThreads.size(); ++t) {
+                                setFillThreadCount(fillThreads[t]);
+                                resetTransferRate();
+                                runFrames(0, matrixWarmupSeconds);
+                                RunResult result = runFrames(0, matrixMeasureSeconds);
+                                if (t == 0)
+                                    baseUpdateTime = result.updateTime;
+                                if (fillThreads.size() > 1 && result.updateTime > 0)
+                                    result.updateSpeedup = baseUpdateTime / result.updateTime;
+                                if (k == 0 && t == 0)
+                                    result.reconfigureTime = reconfigureTime; // The others reuse the same buffers
+                                writeRecord(out, result);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    setPboMethod(NONE, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// write one CSV or JSON Lines record for the current configuration
+///////////////////////////////////////////////////////////////////////////////
+void writeRecord(std::ostream& out, const RunResult& result)
+{
+    double frameRate = result.frameCount / result.elapsedTime;
+    double transferRate = frameRate * dataSize / (1024 * 1024);
+
+    // Percentile columns, in the order of the CSV header
+    const char* histogramNames[] = { "update", "copy", "frame" };
+    const LatencyHistogram* histograms[] = { &result.updateHistogram, &result.copyHistogram, &result.frameHistogram };
+    const char* percentileNames[] = { "p50", "p90", "p99", "p999" };
+    const double percentiles[] = { 50, 90, 99, 99.9 };
+    const FenceWaits& pboWaits = result.pboFenceWaits;
+    const FenceWaits& textureWaits = result.textureFenceWaits;
+    double stallRate = (pboWaits.waitCount > 0) ? (double)pboWaits.stallCount / pboWaits.waitCount : 0;
+    double blockedTime = pboWaits.waitMicroSeconds * 1e-3 / result.elapsedTime;
+    double textureBlockedTime = textureWaits.waitMicroSeconds * 1e-3 / result.elapsedTime;
+
+    out << std::fixed << std::setprecision(3);
+    if (matrixJson) {
+        out << "{\"method\": " << (int)pboMethod
+            << ", \"method_name\": \"" << getPboMethodName(pboMethod) << "\""
+            << ", \"pbo_count\": " << pboCount
+            << ", \"texture_count\": " << textureCount
+            << ", \"width\": " << imageWidth
+            << ", \"height\": " << imageHeight
+            << ", \"pixel_format\": \"" << PIXEL_FORMATS[pixelFormatIdx].name << "\""
+            << ", \"huge_pages\": \"" << HUGE_PAGES_OPTIONS[imageDataPages] << "\""
+            << ", \"fill_kernel\": \"" << FILL_KERNEL_OPTIONS[fillKernel] << "\""
+            << ", \"fill_threads\": " << fillThreadCount
+            << ", \"frames\": " << result.frameCount
+            << ", \"seconds\": " << result.elapsedTime
+            << ", \"fps\": " << frameRate
+            << ", \"mb_per_s\": " << transferRate
+            << ", \"update_ms\": " << result.updateTime;
+        if (result.updateSpeedup >= 0)
+            out << ", \"update_speedup\": " << result.updateSpeedup;
+        else
+            out << ", \"update_speedup\": null";
+        out << ", \"copy_ms\": " << result.copyTime;
+        if (result.gpuCopyTime >= 0) {
+            out << ", \"gpu_copy_ms\": " << result.gpuCopyTime
+                << ", \"gpu_mb_per_s\": " << result.gpuCopyRate;
+        }
+        else {
+            out << ", \"gpu_copy_ms\": null, \"gpu_mb_per_s\": null";
+        }
+        out << ", \"fence_waits\": " << pboWaits.waitCount
+            << ", \"fence_signaled\": " << pboWaits.signaledCount
+            << ", \"fence_stalls\": " << pboWaits.stallCount
+            << ", \"fence_failed\": " << pboWaits.failedCount
+            << ", \"fence_stall_rate\": " << stallRate
+            << ", \"fence_blocked_ms_per_s\": " << blockedTime
+            << ", \"texture_fence_waits\": " << textureWaits.waitCount
+            << ", \"texture_fence_stalls\": " << textureWaits.stallCount
+            << ", \"texture_fence_blocked_ms_per_s\": " << textureBlockedTime;
+        if (result.dtlbMisses >= 0)
+            out << ", \"dtlb_misses_per_frame\": " << result.dtlbMisses;
+        else
+            out << ", \"dtlb_misses_per_frame\": null";
+        if (result.pageFaults >= 0)
+            out << ", \"page_faults\": " << result.pageFaults;
+        else
+            out << ", \"page_faults\": null";
+        if (result.reconfigureTime >= 0)
+            out << ", \"reconfigure_ms\": " << result.reconfigureTime;
+        else
+            out << ", \"reconfigure_ms\": null";
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                out << ", \"" << histogramNames[i] << "_" << percentileNames[j] << "_ms\": "
+                    << histograms[i]->getPercentile(percentiles[j]);
+            }
+            out << ", \"" << histogramNames[i] << "_max_ms\": " << histograms[i]->getMax();
+        }
+        out << "}";
+    }
+    else {
+        out << (int)pboMethod
+            << ",\"" << getPboMethodName(pboMethod) << "\""
+            << "," << pboCount
+            << "," << textureCount
+            << "," << imageWidth
+            << "," << imageHeight
+            << "," << PIXEL_FORMATS[pixelFormatIdx].name
+            << "," << HUGE_PAGES_OPTIONS[imageDataPages]
+            << "," << FILL_KERNEL_OPTIONS[fillKernel]
+            << "," << fillThreadCount
+            << "," << result.frameCount
+            << "," << result.elapsedTime
+            << "," << frameRate
+            << "," << transferRate
+            << "," << result.updateTime;
+        if (result.updateSpeedup >= 0)
+            out << "," << result.updateSpeedup;
+        else
+            out << ","; // Single thread count
+        out << "," << result.copyTime;
+        if (result.gpuCopyTime >= 0)
+            out << "," << result.gpuCopyTime << "," << result.gpuCopyRate;
+        else
+            out << ",,"; // Not measured
+        out << "," << pboWaits.waitCount
+            << "," << pboWaits.signaledCount
+            << "," << pboWaits.stallCount
+            << "," << pboWaits.failedCount
+            << "," << stallRate
+            << "," << blockedTime
+            << "," << textureWaits.waitCount
+            << "," << textureWaits.stallCount
+            << "," << textureBlockedTime;
+        if (result.dtlbMisses >= 0)
+            out << "," << result.dtlbMisses;
+        else
+            out << ","; // Not counted
+        if (result.pageFaults >= 0)
+            out << "," << result.pageFaults;
+        else
+            out << ",";
+        if (result.reconfigureTime >= 0)
+            out << "," << result.reconfigureTime;
+        else
+            out << ","; // Same buffers as the previous record
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 4; ++j)
+                out << "," << histograms[i]->getPercentile(percentiles[j]);
+            out << "," << histograms[i]->getMax();
+        }
+    }
+    out << std::resetiosflags(std::ios_base::fixed | std::ios_base::floatfield);
+    out << endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// read the command line options
+// The GLUT options (single dash, e.g. -display) are left to glutInit().
+///////////////////////////////////////////////////////////////////////////////
+bool parseArguments(int argc, char **argv)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = (i + 1 < argc);
+        if (arg == "--headless") {
+            headless = true;
+        }
+        else if (arg == "--frames" && hasValue) {
+            headlessFrames = atoi(argv[++i]);
+        }
+        else if (arg == "--seconds" && hasValue) {
+            headlessSeconds = atof(argv[++i]);
+        }
+        else if (arg == "--method" && hasValue) {
+            startMethod = atoi(argv[++i]);
+        }
+        else if (arg == "--pbo" && hasValue) {
+            startPboCount = atoi(argv[++i]);
+            startPboCountSet = true;
+        }
+        else if (arg == "--no-calibrate") {
+            calibrationEnabled = false;
+        }
+        else if (arg == "--calibrate-by" && hasValue) {
+            std::string criterion = argv[++i];
+            if (criterion != "throughput" && criterion != "p99") {
+                printUsage(argv[0]);
+                return false;
+            }
+            calibrationByP99 = (criterion == "p99");
+        }
+        else if (arg == "--size" && hasValue) {
+            int width = 0, height = 0;
+            if (!parseSize(argv[++i], width, height) || !initImageFormat(width, height, pixelFormatIdx)) {
+                printUsage(argv[0]);
+                return false;
+            }
+        }
+        else if (arg == "--format" && hasValue) {
+            int formatIdx = findPixelFormat(argv[++i]);
+            if (formatIdx < 0 || !initImageFormat(imageWidth, imageHeight, formatIdx)) {
+                printUsage(argv[0]);
+                return false;
+            }
+        }
+        else if (arg == "--sizes" && hasValue) {
+            std::stringstream ss(argv[++i]);
+            std::string item;
+            while (std::getline(ss, item, ',')) {
+                int width = 0, height = 0;
+                if (!parseSize(item, width, height)) {
+                    printUsage(argv[0]);
+                    return false;
+                }
+                matrixSizes.push_back(width);
+                matrixSizes.push_back(height);
+            }
+        }
+        else if (arg == "--formats" && hasValue) {
+            std::stringstream ss(argv[++i]);
+            std::string item;
+            while (std::getline(ss, item, ',')) {
+                int formatIdx = findPixelFormat(item);
+                if (formatIdx < 0) {
+                    printUsage(argv[0]);
+                    return false;
+                }
+                matrixFormats.push_back(formatIdx);
+            }
+        }
+        else if (arg == "--fill" && hasValue) {
+            int kernel = findFillKernel(argv[++i]);
+            if (kernel < 0) {
+                printUsage(argv[0]);
+                return false;
+            }
+            fillKernel = (FillKernel)kernel;
+            fillKernelSet = true;
+        }
+        else if (arg == "--fills" && hasValue) {
+            std::stringstream ss(argv[++i]);
+            std::string item;
+            while (std::getline(ss, item, ',')) {
+                int kernel = findFillKernel(item);
+                if (kernel < 0) {
+                    printUsage(argv[0]);
+                    return false;
+                }
+                matrixFillKernels.push_back(kernel);
+            }
+        }
+        else if (arg == "--threads" && hasValue) {
+            fillThreadCount = atoi(argv[++i]);
+        }
+        else if (arg == "--thread-counts" && hasValue) {
+            if (!parseIntList(argv[++i], matrixFillThreads)) {
+                cout << "ERROR [parseArguments]: --thread-counts expects comma separated integers, e.g. 1,2,4" << endl;
+                printUsage(argv[0]);
+                return false;
+            }
+        }
+        else if (arg == "--huge-pages" && hasValue) {
+            int mode = findHugePages(argv[++i]);
+            if (mode < 0) {
+                printUsage(argv[0]);
+                return false;
+            }
+            hugePages = (HugePages)mode;
+        }
+        else if (arg == "--huge-pages-modes" && hasValue) {
+            std::stringstream ss(argv[++i]);
+            std::string item;
+            while (std::getline(ss, item, ',')) {
+                int mode = findHugePages(item);
+                if (mode < 0) {
+                    printUsage(argv[0]);
+                    return false;
+                }
+                matrixHugePages.push_back(mode);
+            }
+        }
+        else if (arg == "--staging-pool" && hasValue) {
+            stagingPoolMB = atoi(argv[++i]);
+        }
+        else if (arg == "--no-staging-pool") {
+            stagingPoolEnabled = false;
+        }
+        else if (arg == "--prefault") {
+            prefaultEnabled = true;
+        }
+        else if (arg == "--first-frames" && hasValue) {
+            firstFrameCount = atoi(argv[++i]);
+        }
+        else if (arg == "--numa-node" && hasValue) {
+            numaNode = atoi(argv[++i]);
+        }
+        else if (arg == "--adaptive") {
+            adaptivePboCount = true;
+        }
+        else if (arg == "--matrix") {
+            matrixMode = headless = true;
+        }
+        else if (arg == "--methods" && hasValue) {
+            if (!parseIntList(argv[++i], matrixMethods))
+                matrixMethods.push_back(-1); // Rejected below
+        }
+        else if (arg == "--pbos" && hasValue) {
+            if (!parseIntList(argv[++i], matrixPboCounts))
+                matrixPboCounts.push_back(-1);
+        }
+        else if (arg == "--warmup" && hasValue) {
+            matrixWarmupSeconds = atof(argv[++i]);
+        }
+        else if (arg == "--measure" && hasValue) {
+            matrixMeasureSeconds = atof(argv[++i]);
+        }
+        else if (arg == "--records" && hasValue) {
+            std::string format = argv[++i];
+            if (format != "csv" && format != "json") {
+                printUsage(argv[0]);
+                return false;
+            }
+            matrixJson = (format == "json");
+        }
+        else if (arg == "--output" && hasValue) {
+            matrixOutput = argv[++i];
+        }
+        else if (arg.compare(0, 2, "--") == 0) {
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+
+    bool valid = (startMethod < PBO_METHOD_COUNT && startPboCount >= 1 && startPboCount <= 9);
+    for (size_t i = 0; i < matrixMethods.size(); ++i)
+        valid = valid && matrixMethods[i] >= 0 && matrixMethods[i] < PBO_METHOD_COUNT;
+    for (size_t i = 0; i < matrixPboCounts.size(); ++i)
+        valid = valid && matrixPboCounts[i] >= 1 && matrixPboCounts[i] <= 9;
+    valid = valid && fillThreadCount >= 1 && fillThreadCount <= MAX_FILL_THREADS && numaNode >= -1 && firstFrameCount >= 0
+            && stagingPoolMB >= 1;
+    for (size_t i = 0; i < matrixFillThreads.size(); ++i)
+        valid = valid && matrixFillThreads[i] >= 1 && matrixFillThreads[i] <= MAX_FILL_THREADS;
+    if (!valid || matrixMeasureSeconds <= 0) {
+        printUsage(argv[0]);
+        return false;
+    }
+    if (matrixMode) {
+        adaptivePboCount = false; // The matrix sets the PBO counts
+    }
+    if (headless && headlessFrames <= 0 && headlessSeconds <= 0) {
+        headlessSeconds = 10; // Default length of a headless run
+    }
+    return true;
+}
+
+void printUsage(const char* program)
+{
+    cout << "Usage: " << program << " [options]\n"
+         << "  --method N    start with PBO method N (0-" << PBO_METHOD_COUNT - 1 << ", see SPACE key)\n"
+         << "  --pbo N       start with N PBOs (1-9, default 1)\n"
+         << "  --size WxH    frame size in pixels (default 4096x4096, see 's' key)\n"
+         << "  --format F    pixel format: BGRA8 (default), RGBA8, RGB8, R8, R16 or RGBA16F (see 'f' key)\n"
+         << "  --fill K      pixel writing kernel: scalar, sse2 or avx2 (default: widest supported, see 'k' key)\n"
+         << "  --threads N   threads writing the pixels (1-" << MAX_FILL_THREADS << ", default 1, see 'w' key)\n"
+         << "  --huge-pages P  pages of the system memory buffers: off (default), thp (transparent),\n"
+         << "                2mb or 1gb (reserved), falling back to smaller ones (see 'h' key)\n"
+         << "  --staging-pool MB  keep up to MB of released buffers for the next reconfigurations (default 1024, see 'o' key)\n"
+         << "  --no-staging-pool  delete and create the buffers at each reconfiguration\n"
+         << "  --prefault    fault in and lock (mlock) the staging buffers when they are created (see 'l' key)\n"
+         << "  --first-frames N  frames timed after each reallocation of the buffers (default 10, 0: none)\n"
+         << "  --numa-node N bind the threads and the system memory buffers to NUMA node N\n"
+         << "  --adaptive    adjust the PBO count to the fence stalls (see 'a' key)\n"
+         << "  --no-calibrate start with no PBO instead of the fastest method (without --method)\n"
+         << "  --calibrate-by C  fastest method: throughput (default) or p99 (frame time, over 100 frames per method)\n"
+         << "  --headless    run without any window on an EGL context, then exit\n"
+         << "  --frames N    headless: stop after N frames\n"
+         << "  --seconds S   headless: stop after S seconds (default 10 without --frames)\n"
+         << "  --matrix      headless: sweep every combination of methods and PBO counts\n"
+         << "  --methods L   matrix: comma separated methods (default: all supported)\n"
+         << "  --pbos L      matrix: comma separated PBO counts (default: 1,2,3)\n"
+         << "  --sizes L     matrix: comma separated frame sizes, e.g. 1920x1080,3840x2160 (default: --size)\n"
+         << "  --formats L   matrix: comma separated pixel formats (default: --format)\n"
+         << "  --fills L     matrix: comma separated fill kernels (default: --fill)\n"
+         << "  --thread-counts L  matrix: comma separated fill thread counts, with the speedups\n"
+         << "                over the first one (default: --threads)\n"
+         << "  --huge-pages-modes L  matrix: comma separated huge pages modes (default: --huge-pages)\n"
+         << "  --warmup S    matrix: seconds run before measuring each configuration (default 1)\n"
+         << "  --measure S   matrix: seconds measured for each configuration (default 3)\n"
+         << "  --records F   matrix: record format, csv or json (JSON Lines, default csv)\n"
+         << "  --output FILE matrix: write the records to FILE instead of the standard output" << endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// parse a comma separated list of integers, e.g. "1,3,5"
+///////////////////////////////////////////////////////////////////////////////
+bool parseIntList(const char* text, std::vector<int>& values)
+{
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        char* end = NULL;
+        long value = strtol(item.c_str(), &end, 10);
+        if (item.empty() || *end != '\0')
+            return false;
+        values.push_back((int)value);
+    }
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// initialize global variables
+///////////////////////////////////////////////////////////////////////////////
+bool initSharedMem()
+{
+    screenWidth = SCREEN_WIDTH;
     screenHeight = SCREEN_HEIGHT;
 
     mouseLeftDown = mouseRightDown = false;
@@ -712,10 +2495,7 @@ bool initSharedMem()
     drawMode = 0; // 0:fill, 1: wireframe, 2:points
 
     // allocate texture buffer
-    imageData = new GLubyte[DATA_SIZE];
-    memset(imageData, 0, DATA_SIZE);
-
-    return true;
+    return allocImageData();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -724,13 +2504,17 @@ bool initSharedMem()
 void clearSharedMem()
 {
     // deallocate texture buffer
-    delete [] imageData; imageData = NULL;
+    releaseImageData();
 
-    // clean up texture
-    glDeleteTextures(1, &textureId);
+    // clean up textures
+    clearTextures();
 
     // clean up PBOs
     setPboCount(0);
+    stagingPool.clear(); // While the GL context is still current
+
+    clearGpuTimers();
+    uploadContext.destroy();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -768,24 +2552,254 @@ void setCamera(float posX, float posY, float posZ, float targetX, float targetY,
 ///////////////////////////////////////////////////////////////////////////////
 void updatePixels(GLubyte* dst, int size)
 {
-    static int color = 0;
-
     if(!dst)
         return;
 
-    int* ptr = (int*)dst;
+    beginPixelUpdate();
+    updatePixelRows(dst, 0, imageHeight);
+    endPixelUpdate();
+}
 
-    // copy 4 bytes at once
-    for(int i = 0; i < IMAGE_HEIGHT; ++i)
-    {
-        for(int j = 0; j < IMAGE_WIDTH; ++j)
+///////////////////////////////////////////////////////////////////////////////
+// decide which areas of the frame will be written (dirtyRects)
+// A frame can then be written in several bands with updatePixelRows(), and
+// it is finished with endPixelUpdate().
+///////////////////////////////////////////////////////////////////////////////
+void beginPixelUpdate()
+{
+    dirtyRects.clear();
+
+    // A buffer orphaned or invalidated before the update holds undefined
+    // pixels outside of the areas written, so the whole frame is written when
+    // the whole frame is copied from it (see getCopyRects())
+    bool wholeFrameCopied = textureCount > 1 && isPboMethodDiscarding(pboMethod);
+
+    if (updatePattern == UPDATE_FULL || wholeFrameCopied) {
+        DirtyRect r = { 0, 0, imageWidth, imageHeight };
+        dirtyRects.push_back(r);
+    }
+    else if (updatePattern == UPDATE_PARTIAL) {
+        // Only a strip of rows is written, the previous contents of the
+        // buffer are kept everywhere else
+        int rowCount = getPartialRowCount();
+        if (partialRow + rowCount > imageHeight)
+            partialRow = 0;
+        DirtyRect r = { 0, partialRow, imageWidth, rowCount };
+        dirtyRects.push_back(r);
+    }
+    else {
+        // A few rectangles at pseudo-random positions
+        static unsigned int seed = 1;
+        int width = (DIRTY_RECT_SIZE < imageWidth) ? DIRTY_RECT_SIZE : imageWidth;
+        int height = (DIRTY_RECT_SIZE < imageHeight) ? DIRTY_RECT_SIZE : imageHeight;
+        for (int i = 0; i < DIRTY_RECT_COUNT; ++i) {
+            seed = seed * 1103515245 + 12345;
+            int x = (seed >> 8) % (imageWidth - width + 1);
+            seed = seed * 1103515245 + 12345;
+            int y = (seed >> 8) % (imageHeight - height + 1);
+            DirtyRect r = { x, y, width, height };
+            dirtyRects.push_back(r);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// write the dirty areas of the frame found in rows [firstRow, firstRow + rowCount)
+///////////////////////////////////////////////////////////////////////////////
+void updatePixelBand(GLubyte* dst, int firstRow, int rowCount)
+{
+    for (size_t k = 0; k < dirtyRects.size(); ++k) {
+        const DirtyRect& r = dirtyRects[k];
+        int rowBegin = (r.y > firstRow) ? r.y : firstRow;
+        int rowEnd = (r.y + r.height < firstRow + rowCount) ? r.y + r.height : firstRow + rowCount;
+
+        int color = pixelColor + 257 * rowBegin;
+
+        for(int i = rowBegin; i < rowEnd; ++i)
         {
-            *ptr = color;
-            ++ptr;
+            // The pixel is made of the lowest bytes of 'value' (little endian),
+            // 8-byte pixels repeat 'color' twice
+            long long value = ((long long)color << 32) | (unsigned int)color;
+            GLubyte* row = dst + ((size_t)i * imageWidth + r.x) * bytesPerPixel;
+            fillPixels(fillKernel, row, &value, bytesPerPixel, r.width);
+            color += 257;   // add an arbitary number (no meaning)
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// write the rows [firstRow, firstRow + rowCount) of the frame with all the
+// threads of fillPool, each one writing its own band of rows
+// It returns once all the bands are written, so the buffer can be unmapped,
+// fenced or copied right after.
+///////////////////////////////////////////////////////////////////////////////
+struct FillRows {
+    GLubyte* dst;
+    int firstRow;
+    int rowCount;
+};
+
+void updatePixelRows(GLubyte* dst, int firstRow, int rowCount)
+{
+    if (fillPool.getThreadCount() == 1) {
+        updatePixelBand(dst, firstRow, rowCount);
+        return;
+    }
+
+    FillRows rows = { dst, firstRow, rowCount };
+    fillPool.run(fillRowsTask, &rows);
+}
+
+void fillRowsTask(int index, int count, void* arg)
+{
+    const FillRows& rows = *(const FillRows*)arg;
+    int rowBegin = rows.firstRow + (int)((long long)rows.rowCount * index / count);
+    int rowEnd = rows.firstRow + (int)((long long)rows.rowCount * (index + 1) / count);
+    if (rowBegin < rowEnd)
+        updatePixelBand(rows.dst, rowBegin, rowEnd - rowBegin);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// (re)start the fill threads
+// The producer and upload worker threads run fillPool too, so they are stopped
+// while the pool is replaced, then restarted if they were running.
+///////////////////////////////////////////////////////////////////////////////
+void setFillThreadCount(int count)
+{
+    if (fillPool.getThreadCount() == count) {
+        fillThreadCount = count;
+        return;
+    }
+
+    bool producer = producerRunning;
+    bool uploadWorker = uploadWorkerRunning;
+    stopProducer();
+    stopUploadWorker();
+
+    fillThreadCount = count;
+    fillPool.start(count);
+
+    if (producer)
+        startProducer();
+    if (uploadWorker)
+        startUploadWorker();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// byte ranges of a frame buffer covered by the rectangles 'rects', sorted
+// A rectangle narrower than the frame is one range per row. The overlapping
+// and adjacent ranges are merged, so that each byte is in a single range.
+///////////////////////////////////////////////////////////////////////////////
+bool compareByteRanges(const ByteRange& a, const ByteRange& b)
+{
+    return a.offset < b.offset;
+}
+
+void getDirtyRanges(const std::vector<DirtyRect>& rects, std::vector<ByteRange>& ranges)
+{
+    ranges.clear();
+    for (size_t k = 0; k < rects.size(); ++k) {
+        const DirtyRect& r = rects[k];
+        if (r.width == imageWidth) {
+            ByteRange range = { (GLintptr)r.y * imageWidth * bytesPerPixel,
+                                (GLsizeiptr)r.height * imageWidth * bytesPerPixel }; // Whole rows are contiguous
+            ranges.push_back(range);
+            continue;
+        }
+        for (int i = 0; i < r.height; ++i) {
+            ByteRange range = { ((GLintptr)(r.y + i) * imageWidth + r.x) * bytesPerPixel,
+                                (GLsizeiptr)r.width * bytesPerPixel };
+            ranges.push_back(range);
+        }
+    }
+    std::sort(ranges.begin(), ranges.end(), compareByteRanges);
+
+    size_t count = 0;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        if (count > 0 && ranges[i].offset <= ranges[count - 1].offset + ranges[count - 1].length) {
+            GLintptr end = ranges[i].offset + ranges[i].length;
+            if (end > ranges[count - 1].offset + ranges[count - 1].length)
+                ranges[count - 1].length = end - ranges[count - 1].offset;
+        }
+        else {
+            ranges[count++] = ranges[i];
+        }
+    }
+    ranges.resize(count);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// areas of the frame that have to be copied to the texture
+// With a ring of textures, each texture misses the areas written while the
+// other ones were updated, so the whole frame is copied instead.
+// Passing an empty list also returns the whole frame.
+///////////////////////////////////////////////////////////////////////////////
+const std::vector<DirtyRect>& getCopyRects(const std::vector<DirtyRect>& rects)
+{
+    fullFrameRects[0].x = fullFrameRects[0].y = 0;
+    fullFrameRects[0].width = imageWidth;
+    fullFrameRects[0].height = imageHeight;
+
+    if (textureCount > 1 || rects.empty())
+        return fullFrameRects;
+    return rects;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// copy the areas 'rects' found in rows [firstRow, firstRow + rowCount) of a
+// full frame to the texture
+// 'pixels' points to the frame, or is its offset if a PBO is bound. Only the
+// sub-rectangles are read from it, using the unpack row length and skip
+// parameters.
+///////////////////////////////////////////////////////////////////////////////
+void copyPixelRects(const std::vector<DirtyRect>& rects, const GLubyte* pixels, int firstRow, int rowCount)
+{
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, imageWidth);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // Rows are tightly packed, e.g. RGB8
+
+    for (size_t k = 0; k < rects.size(); ++k) {
+        const DirtyRect& r = rects[k];
+        int rowBegin = (r.y > firstRow) ? r.y : firstRow;
+        int rowEnd = (r.y + r.height < firstRow + rowCount) ? r.y + r.height : firstRow + rowCount;
+        if (rowBegin >= rowEnd)
+            continue;
+
+        glPixelStorei(GL_UNPACK_SKIP_PIXELS, r.x);
+        glPixelStorei(GL_UNPACK_SKIP_ROWS, rowBegin);
+        if (pboMethod == DSA) {
+            glTextureSubImage2D(textureIds[copyTextureIdx], 0, r.x, rowBegin, r.width, rowEnd - rowBegin,
+                                pixelFormat, pixelType, (GLvoid*)pixels);
+        }
+        else {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, r.x, rowBegin, r.width, rowEnd - rowBegin,
+                            pixelFormat, pixelType, (GLvoid*)pixels);
         }
-        color += 257;   // add an arbitary number (no meaning)
+        copiedBytes += (long long)r.width * (rowEnd - rowBegin) * bytesPerPixel;
+    }
+
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// rows of the strip written by UPDATE_PARTIAL, at least 1 for small frames
+///////////////////////////////////////////////////////////////////////////////
+int getPartialRowCount()
+{
+    int rowCount = imageHeight / PARTIAL_UPDATE_DIVISOR;
+    return (rowCount < 1) ? 1 : rowCount;
+}
+
+void endPixelUpdate()
+{
+    if (updatePattern == UPDATE_PARTIAL) {
+        partialRow = (partialRow + getPartialRowCount()) % imageHeight;
     }
-    ++color;            // scroll down
+
+    pixelColor += 257 * imageHeight;
+    ++pixelColor;       // scroll down
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -859,24 +2873,14 @@ void showInfo()
     if (pboCount == 0)
         ss << "off" << ends;
     else
-        ss << pboCount << " PBO(s)" << ends;
+        ss << pboCount << " PBO(s)";
+    if (adaptivePboCount)
+        ss << " (adaptive)";
+    ss << ends;
     drawString(ss.str().c_str(), 1, screenHeight-TEXT_HEIGHT, color, font);
     ss.str(""); // clear buffer
 
-    ss << "PBO Method: ";
-    switch (pboMethod) {
-    case NONE:
-        ss << "None (direct transfer)" << ends; break;
-    case ORPHAN:
-        ss << "Orphaning" << ends; break;
-    case UNSYNCH_ORPHAN:
-        ss << "Unsynchronized with orphaning" << ends; break;
-    case UNSYNCH_FENCES:
-        ss << "Unsynchronized with fences synchronization" << ends; break;
-    case AMD:
-        ss << "AMD_pinned_memory" << ends; break;
-    default: break;
-    }
+    ss << "PBO Method: " << getPboMethodName(pboMethod) << ends;
     drawString(ss.str().c_str(), 1, screenHeight-(2*TEXT_HEIGHT), color, font);
     ss.str("");
 
@@ -885,10 +2889,52 @@ void showInfo()
     drawString(ss.str().c_str(), 1, screenHeight-(3*TEXT_HEIGHT), color, font);
     ss.str("");
 
-    ss << "Copying Time: " << copyTime << " ms" << ends;
+    ss << "Copying Time: " << copyTime << " ms";
+    if (gpuCopyTime > 0)
+        ss << " (GPU: " << gpuCopyTime << " ms, " << std::setprecision(1) << gpuCopyRate << " MB/s)";
+    ss << ends;
     drawString(ss.str().c_str(), 1, screenHeight-(4*TEXT_HEIGHT), color, font);
     ss.str("");
 
+    ss << "Update Pattern: ";
+    if (updatePattern == UPDATE_FULL)
+        ss << "Full frame" << ends;
+    else if (updatePattern == UPDATE_PARTIAL)
+        ss << "Partial (1/" << PARTIAL_UPDATE_DIVISOR << " rows)" << ends;
+    else
+        ss << "Dirty rectangles (" << DIRTY_RECT_COUNT << " of " << DIRTY_RECT_SIZE << "x" << DIRTY_RECT_SIZE << ")" << ends;
+    drawString(ss.str().c_str(), 1, screenHeight-(5*TEXT_HEIGHT), color, font);
+    ss.str("");
+
+    ss << "Texture Count: " << textureCount << ends;
+    drawString(ss.str().c_str(), 1, screenHeight-(6*TEXT_HEIGHT), color, font);
+    ss.str("");
+
+    ss << "Frame: " << imageWidth << "x" << imageHeight << " " << PIXEL_FORMATS[pixelFormatIdx].name
+       << " (" << dataSize / (1024.0 * 1024) << " MB, " << getHugePagesName(imageDataPages) << ")" << ends;
+    drawString(ss.str().c_str(), 1, screenHeight-(7*TEXT_HEIGHT), color, font);
+    ss.str("");
+
+    ss << "Producer Thread: ";
+    if (producerRunning)
+        ss << "on" << ends;
+    else if (producerEnabled)
+        ss << "on (not available for this method)" << ends;
+    else
+        ss << "off" << ends;
+    drawString(ss.str().c_str(), 1, screenHeight-(8*TEXT_HEIGHT), color, font);
+    ss.str("");
+
+    ss << "Fill Kernel: " << getFillKernelName(fillKernel) << ", " << fillThreadCount << " thread(s)" << ends;
+    drawString(ss.str().c_str(), 1, screenHeight-(9*TEXT_HEIGHT), color, font);
+    ss.str("");
+
+    if (pboMethod == BANDED) {
+        ss << "Band Count: " << bandCount << ends;
+        drawString(ss.str().c_str(), 1, screenHeight-(10*TEXT_HEIGHT), color, font);
+        ss.str("");
+    }
+
     ss << "Press SPACE key to toggle PBO on/off." << ends;
     drawString(ss.str().c_str(), 1, 1, color, font);
 
@@ -921,7 +2967,7 @@ void showTransferRate()
     glMatrixMode(GL_PROJECTION);        // switch to projection matrix
     glPushMatrix();                     // save current projection matrix
     glLoadIdentity();                   // reset projection matrix
-    //gluOrtho2D(0, IMAGE_WIDTH, 0, IMAGE_HEIGHT); // set to orthogonal projection
+    //gluOrtho2D(0, imageWidth, 0, imageHeight); // set to orthogonal projection
     gluOrtho2D(0, screenWidth, 0, screenHeight); // set to orthogonal projection
 
     float color[4] = {1, 1, 0, 1};
@@ -936,7 +2982,7 @@ void showTransferRate()
     {
         ss.str("");
         ss << std::fixed << std::setprecision(1);
-        ss << "Transfer Rate: " << (count / elapsedTime) * DATA_SIZE / (1024 * 1024) << " MB" << ends; // update fps string
+        ss << "Transfer Rate: " << (count / elapsedTime) * dataSize / (1024 * 1024) << " MB" << ends; // update fps string
         ss << std::resetiosflags(std::ios_base::fixed | std::ios_base::floatfield);
         count = 0;                      // reset counter
         timer.start();                  // restart timer
@@ -959,6 +3005,35 @@ void printTransferRate()
     static const double INV_MEGA = 1.0 / (1024 * 1024);
     static Timer timer;
     static int count = 0;
+    static double updateTimeSum = 0;
+    static double copyTimeSum = 0;
+    static double waitTimeSum = 0;
+    static long long gpuNanoSecondsBegin = 0;
+    static long long gpuBytesBegin = 0;
+    static FenceWaits pboFenceWaitsBegin = { 0, 0, 0, 0, 0 };
+    static FenceWaits textureFenceWaitsBegin = { 0, 0, 0, 0, 0 };
+    static MemoryCounters memoryBegin = { -1, -1, -1 };
+
+    updateTimeSum += updateTime;
+    copyTimeSum += copyTime;
+    waitTimeSum += waitTime;
+
+    if (firstFramesPending) {
+        firstFrameTimes.push_back(updateTime + copyTime);
+        if ((int)firstFrameTimes.size() >= firstFrameCount) {
+            printFirstFrames();
+            firstFramesPending = false;
+        }
+    }
+
+    if (rateDiscarded == 0) {
+        if (frameHistogram.getCount() == 0)
+            latencyLabel = getConfigLabel();
+        updateHistogram.add(updateTime);
+        copyHistogram.add(copyTime);
+        if (frameTime > 0)
+            frameHistogram.add(frameTime);
+    }
 
     // loop until 1 sec passed
     double elapsedTime = timer.getElapsedTime();
@@ -971,8 +3046,10 @@ void printTransferRate()
         }
         else {
             ++rateCount;
+            if (rateCount == 1)
+                printPagePlacement(); // The buffers have been written for a few seconds
 
-            double transferRate = (count / elapsedTime) * DATA_SIZE * INV_MEGA;
+            double transferRate = (count / elapsedTime) * dataSize * INV_MEGA;
             transferRateSum += transferRate;
             double transferRateAvg = transferRateSum / rateCount;
 
@@ -981,26 +3058,268 @@ void printTransferRate()
             double frameRateAvg = frameRateSum / rateCount;
 
             cout << std::fixed << std::setprecision(1);
+            cout << getConfigLabel() << " ";
             cout << "Transfer Rate: " << transferRate
                  << " MB/s @ " << frameRate
                  << " FPS -- Average: " << transferRateAvg
                  << " MB/s @ " << frameRateAvg << " FPS";
+
+            // The sums also include the current frame
+            cout << std::setprecision(3);
+            cout << " -- Update: " << updateTimeSum / (count + 1)
+                 << " ms, Copy: " << copyTimeSum / (count + 1) << " ms";
+            if (producerRunning || uploadWorkerRunning) {
+                // Update happens on another thread, Wait is the GL thread idling for it
+                cout << ", Wait: " << waitTimeSum / (count + 1) << " ms";
+            }
+            cout << std::setprecision(1);
+            if (updatePattern != UPDATE_FULL) {
+                cout << " -- Copied: " << (copiedBytes / (double)(count + 1)) * INV_MEGA << " MB/frame";
+            }
+            if (pboMethod == PERSISTENT_FLUSH) {
+                cout << " -- Flushed: " << (flushedBytes / (double)(count + 1)) * INV_MEGA << " MB/frame";
+            }
+
+            // GPU time of the copies read back during this second
+            long long gpuNanoSeconds = gpuCopyNanoSeconds - gpuNanoSecondsBegin;
+            if (gpuNanoSeconds > 0) {
+                gpuCopyTime = (float)(gpuNanoSeconds * 1e-6 / (count + 1));
+                gpuCopyRate = (float)((gpuCopyBytes - gpuBytesBegin) * INV_MEGA / (gpuNanoSeconds * 1e-9));
+                cout << std::setprecision(3) << " -- GPU Copy: " << gpuCopyTime << " ms, "
+                     << std::setprecision(1) << gpuCopyRate << " MB/s";
+            }
+            else {
+                gpuCopyTime = gpuCopyRate = 0;
+            }
+
+            // Fence waits during this second, only the fenced methods have some
+            FenceWaits pboWaits = getFenceWaitsSince(pboFenceCounters, pboFenceWaitsBegin);
+            printFenceWaits("PBO fences", pboWaits, elapsedTime);
+            printFenceWaits("Texture fences", getFenceWaitsSince(textureFenceCounters, textureFenceWaitsBegin), elapsedTime);
+
+            // Memory system during this second
+            MemoryCounters memory;
+            readMemoryCounters(memory);
+            if (memory.dtlbMisses >= 0 && memoryBegin.dtlbMisses >= 0) {
+                cout << std::setprecision(1);
+                cout << " -- dTLB misses: " << (memory.dtlbMisses - memoryBegin.dtlbMisses) / (1000.0 * (count + 1)) << " k/frame";
+            }
+            if (memory.minorFaults >= 0 && memoryBegin.minorFaults >= 0) {
+                cout << " -- Page faults: "
+                     << (memory.minorFaults - memoryBegin.minorFaults) + (memory.majorFaults - memoryBegin.majorFaults);
+            }
+
+            // Since the configuration changed
+            cout << std::setprecision(3);
+            cout << " -- Frame p50: " << frameHistogram.getPercentile(50)
+                 << " ms, p99: " << frameHistogram.getPercentile(99)
+                 << " ms, max: " << frameHistogram.getMax() << " ms";
             cout << std::resetiosflags(std::ios_base::fixed | std::ios_base::floatfield);
             cout << endl;
+
+            adaptPboCount(pboWaits.waitCount, pboWaits.stallCount, pboWaits.waitMicroSeconds * 1e-3 / elapsedTime);
         }
         count = 0;     // reset counter
+        updateTimeSum = copyTimeSum = waitTimeSum = 0;
+        flushedBytes = 0;
+        copiedBytes = 0;
+        gpuNanoSecondsBegin = gpuCopyNanoSeconds;
+        gpuBytesBegin = gpuCopyBytes;
+        readFenceCounters(pboFenceCounters, pboFenceWaitsBegin);
+        readFenceCounters(textureFenceCounters, textureFenceWaitsBegin);
+        readMemoryCounters(memoryBegin);
         timer.start(); // restart timer
     }
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// create the ring of timer queries
+///////////////////////////////////////////////////////////////////////////////
+void initGpuTimers()
+{
+    if (!timerQuerySupported)
+        return;
+
+    gpuTimerQueries.resize(GPU_TIMER_QUERY_COUNT);
+    gpuTimerBytes.resize(GPU_TIMER_QUERY_COUNT);
+    glGenQueries(GPU_TIMER_QUERY_COUNT, &gpuTimerQueries[0]);
+    gpuTimerHead = gpuTimerTail = 0;
+}
+
+void clearGpuTimers()
+{
+    if (gpuTimerQueries.empty())
+        return;
+
+    glDeleteQueries((GLsizei)gpuTimerQueries.size(), &gpuTimerQueries[0]);
+    gpuTimerQueries.clear();
+    gpuTimerBytes.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// start/stop timing the GPU commands issued in between
+// Only one query can be active at a time, so they must not be nested.
+///////////////////////////////////////////////////////////////////////////////
+void beginGpuTimer()
+{
+    if (gpuTimerQueries.empty())
+        return;
+
+    // The ring is full: the oldest query is needed again, wait for its result
+    if (gpuTimerHead - gpuTimerTail == gpuTimerQueries.size()) {
+        collectGpuTimers(true);
+    }
+
+    gpuTimerBytesBegin = copiedBytes;
+    glBeginQuery(GL_TIME_ELAPSED, gpuTimerQueries[gpuTimerHead % gpuTimerQueries.size()]);
+}
+
+void endGpuTimer()
+{
+    if (gpuTimerQueries.empty())
+        return;
+
+    glEndQuery(GL_TIME_ELAPSED);
+    gpuTimerBytes[gpuTimerHead % gpuTimerQueries.size()] = copiedBytes - gpuTimerBytesBegin;
+    ++gpuTimerHead;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// add the results of the completed queries to the GPU totals, oldest first
+// If 'wait' is true, block until all the pending queries are completed.
+///////////////////////////////////////////////////////////////////////////////
+void collectGpuTimers(bool wait)
+{
+    while (gpuTimerTail != gpuTimerHead) {
+        int idx = gpuTimerTail % gpuTimerQueries.size();
+        if (!wait) {
+            GLint available = 0;
+            glGetQueryObjectiv(gpuTimerQueries[idx], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                break;
+        }
+
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(gpuTimerQueries[idx], GL_QUERY_RESULT, &elapsed);
+        gpuCopyNanoSeconds += (long long)elapsed;
+        gpuCopyBytes += gpuTimerBytes[idx];
+        ++gpuTimerTail;
+    }
+}
+
 void resetTransferRate()
 {
+    // The previous configuration is over, summarize its timings
+    if (!headless)
+        printLatencySummary();
+    updateHistogram.clear();
+    copyHistogram.clear();
+    frameHistogram.clear();
+
     rateDiscarded = 3; // Discard first measurements
     rateCount = 0;
     transferRateSum = 0;
     frameRateSum = 0;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// print the percentiles of the frames recorded since the last reset
+///////////////////////////////////////////////////////////////////////////////
+void printLatencySummary()
+{
+    if (frameHistogram.getCount() == 0)
+        return;
+
+    cout << latencyLabel << " Latency over " << frameHistogram.getCount() << " frames:" << endl;
+    printPercentiles("Update", updateHistogram);
+    printPercentiles("Copy", copyHistogram);
+    printPercentiles("Frame", frameHistogram);
+}
+
+void printPercentiles(const char* name, const LatencyHistogram& histogram)
+{
+    cout << std::fixed << std::setprecision(3);
+    cout << "    " << std::setw(6) << std::left << name << std::right
+         << " p50: " << histogram.getPercentile(50)
+         << " ms, p90: " << histogram.getPercentile(90)
+         << " ms, p99: " << histogram.getPercentile(99)
+         << " ms, p99.9: " << histogram.getPercentile(99.9)
+         << " ms, max: " << histogram.getMax() << " ms" << endl;
+    cout << std::resetiosflags(std::ios_base::fixed | std::ios_base::floatfield);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// print on which NUMA nodes the pages of the system memory buffers landed
+// Only the buffers of this program and the persistent mappings of the driver
+// are known. Nothing is printed without --numa-node, as nothing is bound.
+///////////////////////////////////////////////////////////////////////////////
+void printPagePlacement()
+{
+    if (numaNode < 0)
+        return;
+
+    std::vector<const GLubyte*> buffers;
+    std::vector<std::string> names;
+    buffers.push_back(imageData);
+    names.push_back("Image data");
+    for (size_t i = 0; i < alignedBuffers.size(); ++i) {
+        stringstream ss;
+        ss << "Memory buffer #" << i;
+        buffers.push_back(alignedBuffers[i]);
+        names.push_back(ss.str());
+    }
+    for (size_t i = 0; i < pboPointers.size(); ++i) {
+        if (pboPointers[i]) {
+            stringstream ss;
+            ss << "PBO mapping #" << i;
+            buffers.push_back(pboPointers[i]);
+            names.push_back(ss.str());
+        }
+    }
+
+    cout << std::fixed << std::setprecision(1);
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        std::vector<int> pageCounts;
+        if (!buffers[i] || !getPageNodes(buffers[i], dataSize, PAGE_PLACEMENT_SAMPLES, pageCounts)) {
+            continue;
+        }
+
+        int total = 0;
+        for (size_t j = 0; j < pageCounts.size(); ++j)
+            total += pageCounts[j];
+        cout << "Pages of " << names[i] << ":";
+        for (size_t j = 0; j + 1 < pageCounts.size(); ++j) {
+            if (pageCounts[j] > 0)
+                cout << " node " << j << ": " << 100.0 * pageCounts[j] / total << "%";
+        }
+        if (pageCounts.back() > 0)
+            cout << " not faulted in: " << 100.0 * pageCounts.back() / total << "%";
+        cout << endl;
+    }
+    cout << std::resetiosflags(std::ios_base::fixed | std::ios_base::floatfield);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// return the current configuration, e.g. "[method, 2 PBO(s), 1 texture(s)]"
+///////////////////////////////////////////////////////////////////////////////
+std::string getConfigLabel()
+{
+    stringstream ss;
+    ss << "[" << getPboMethodName(pboMethod) << ", " << pboCount << " PBO(s), "
+       << textureCount << " texture(s)";
+    if (pboMethod == BANDED) {
+        ss << ", " << bandCount << " band(s)";
+    }
+    if (producerRunning) {
+        ss << ", producer thread";
+    }
+    if (fillThreadCount > 1) {
+        ss << ", " << fillThreadCount << " fill threads";
+    }
+    ss << "]";
+    return ss.str();
+}
+
 void* alignedMalloc(size_t alignment, size_t size)
 {
     // Check that alignment is power of 2
@@ -1050,11 +3369,307 @@ void alignedFree(void* ptr)
 #endif
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// zero filled system memory for a staging buffer, page aligned
+// It is backed by the huge pages of 'hugePages', or by smaller ones if they
+// are not available. 'usedMode' receives the pages used.
+// The huge pages are cleared by the kernel, the system pages by alignedMalloc().
+///////////////////////////////////////////////////////////////////////////////
+GLubyte* allocStagingBuffer(size_t size, HugePages* usedMode)
+{
+    HugePages mode = HUGE_PAGES_OFF;
+    GLubyte* ptr = NULL;
+    if (hugePages != HUGE_PAGES_OFF)
+        ptr = (GLubyte*)allocHugePages(size, hugePages, &mode); // Zero filled by the kernel
+    if (!ptr) {
+        mode = HUGE_PAGES_OFF;
+        ptr = (GLubyte*)alignedMalloc(systemPageSize, size);
+    }
+    if (ptr && numaNode >= 0 && !bindNumaNode(ptr, size, numaNode)) {
+        cout << "ERROR [allocStagingBuffer] (mbind) size: " << size << " node: " << numaNode << endl;
+    }
+    prefaultBuffer(ptr, size); // After mbind(), so the pages land on its node
+    if (usedMode)
+        *usedMode = mode;
+    return ptr;
+}
+
+void freeStagingBuffer(GLubyte* ptr)
+{
+    if (!ptr)
+        return;
+    unlockPages(ptr);
+    if (!freeHugePages(ptr))
+        alignedFree(ptr);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// reallocate the system memory buffers with other pages
+///////////////////////////////////////////////////////////////////////////////
+void setHugePages(HugePages mode)
+{
+    if (mode == hugePages)
+        return;
+
+    hugePages = mode;
+    reallocateBuffers();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// create all the staging buffers again, with the same PBO method and count
+///////////////////////////////////////////////////////////////////////////////
+void reallocateBuffers()
+{
+    int count = pboCount;
+    setPboCount(0);     // Also stops the producer and upload worker threads
+    releaseImageData();
+    stagingPool.clear(); // The buffers kept have the previous pages
+    allocImageData();
+    setPboCount(count);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// fault in the pages of a new staging buffer with all the fill threads, then
+// lock them in RAM, if prefaultEnabled
+// The contents of the buffer are lost.
+///////////////////////////////////////////////////////////////////////////////
+struct PageRange {
+    GLubyte* ptr;
+    size_t size;
+};
+
+void prefaultBuffer(GLubyte* ptr, size_t size)
+{
+    if (!prefaultEnabled || !ptr)
+        return;
+
+    PageRange range = { ptr, size };
+    fillPool.run(touchPagesTask, &range);
+
+    if (!lockPages(ptr, size) && !lockFailed) {
+        cout << "ERROR [prefaultBuffer] (mlock) size: " << size
+             << ", the buffers are faulted in but not locked (see ulimit -l)" << endl;
+        lockFailed = true;
+    }
+}
+
+void touchPagesTask(int index, int count, void* arg)
+{
+    const PageRange& range = *(const PageRange*)arg;
+    size_t pageCount = range.size / systemPageSize;
+    size_t begin = pageCount * index / count * systemPageSize;
+    size_t end = (index + 1 == count) ? range.size : pageCount * (index + 1) / count * systemPageSize;
+    touchPages(range.ptr + begin, end - begin);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// start recording the times of the next firstFrameCount frames
+///////////////////////////////////////////////////////////////////////////////
+void markReallocation()
+{
+    firstFrameTimes.clear();
+    firstFramesPending = (firstFrameCount > 0);
+}
+
+void printFirstFrames()
+{
+    float maxTime = 0, sum = 0;
+    for (size_t i = 0; i < firstFrameTimes.size(); ++i) {
+        maxTime = (firstFrameTimes[i] > maxTime) ? firstFrameTimes[i] : maxTime;
+        sum += firstFrameTimes[i];
+    }
+
+    cout << std::fixed << std::setprecision(1);
+    cout << getConfigLabel() << " First " << firstFrameTimes.size() << " frames after reallocation"
+         << (prefaultEnabled ? " (pre-faulted)" : "") << ", update + copy:";
+    for (size_t i = 0; i < firstFrameTimes.size(); ++i)
+        cout << " " << firstFrameTimes[i];
+    cout << " ms -- Mean: " << sum / firstFrameTimes.size() << " ms, Max: " << maxTime << " ms" << endl;
+    cout << std::resetiosflags(std::ios_base::fixed | std::ios_base::floatfield);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// (re)allocate imageData for the current frame geometry
+///////////////////////////////////////////////////////////////////////////////
+bool allocImageData()
+{
+    releaseImageData();
+    StagingBuffer buffer;
+    if (stagingPool.acquire(dataSize, STAGING_SYSTEM, buffer)) {
+        imageData = buffer.ptr;
+        imageDataPages = (HugePages)buffer.pages;
+        memset(imageData, 0, dataSize); // Holds an old frame, the first texture starts black as a new buffer
+    }
+    else {
+        imageData = allocStagingBuffer(dataSize, &imageDataPages);
+    }
+    markReallocation();
+    if (!imageData)
+        return false;
+    if (hugePages != HUGE_PAGES_OFF)
+        cout << "Image data: " << dataSize << " bytes (" << getHugePagesName(imageDataPages) << ")" << endl;
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// hand imageData over to the staging pool
+///////////////////////////////////////////////////////////////////////////////
+void releaseImageData()
+{
+    if (!imageData)
+        return;
+    StagingBuffer buffer = { 0, imageData, (size_t)dataSize, STAGING_SYSTEM, imageDataPages, NULL }; // glTexSubImage2D() copies it at once
+    stagingPool.release(buffer);
+    imageData = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// delete a staging buffer dropped by stagingPool, the way it was created
+///////////////////////////////////////////////////////////////////////////////
+void destroyStagingBuffer(const StagingBuffer& buffer)
+{
+    if (buffer.fence)
+        glDeleteSync((GLsync)buffer.fence);
+
+    GLuint pboId = buffer.id;
+    switch (buffer.usage) {
+    case STAGING_SYSTEM:
+        freeStagingBuffer(buffer.ptr);
+        break;
+
+    case STAGING_PINNED:
+        glDeleteBuffers(1, &pboId); // Unpin the memory before freeing it
+        freeStagingBuffer(buffer.ptr);
+        cout << "Deleted PBO buffer " << pboId << " and freed its memory buffer" << endl;
+        break;
+
+    default:
+        unlockPages(buffer.ptr);
+        if (buffer.ptr) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pboId);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER); // Release the persistent mapping
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+        glDeleteBuffers(1, &pboId);
+        cout << "Deleted PBO buffer " << pboId << " of size: " << buffer.size << endl;
+        break;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// fence a buffer object before handing it over to the staging pool
+// Most methods do not fence their buffers, and the texture copies of the
+// others may follow their last fence, so a new fence covers all of them.
+///////////////////////////////////////////////////////////////////////////////
+void fenceStagingBuffer(StagingBuffer& buffer)
+{
+    buffer.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// block until the GPU is done with a buffer taken from the staging pool
+// The next method may write it unsynchronized, or through a persistent
+// mapping. The wait is counted apart from the PBO fence waits, which the
+// adaptive PBO count reacts to.
+///////////////////////////////////////////////////////////////////////////////
+void waitStagingBuffer(StagingBuffer& buffer)
+{
+    GLsync fence = (GLsync)buffer.fence;
+    waitFence(fence, stagingFenceCounters);
+    buffer.fence = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// storage of the buffer objects of the current method, their key in the pool
+// DSA creates the same storage as PERSISTENT_COHERENT, and the ring buffer
+// is one coherent buffer for all the slots.
+///////////////////////////////////////////////////////////////////////////////
+unsigned int getPboUsage()
+{
+    switch (pboMethod) {
+    case AMD:
+        return STAGING_PINNED;
+    case PERSISTENT_COHERENT:
+    case PERSISTENT_RING:
+    case DSA:
+    case BANDED:
+    case SHARED_CONTEXT:
+        return STAGING_COHERENT;
+    case PERSISTENT_FLUSH:
+        return STAGING_FLUSH;
+    default:
+        return STAGING_MUTABLE;
+    }
+}
+
+void setStagingPoolEnabled(bool enabled)
+{
+    stagingPoolEnabled = enabled;
+    stagingPool.setCapacity(enabled ? (size_t)stagingPoolMB * 1024 * 1024 : 0); // 0: deletes all
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// time a reconfiguration of the buffers, from startReconfigure() to
+// stopReconfigure(), and print it with the buffers the pool handed back and
+// the time waiting for the GPU to be done with them
+///////////////////////////////////////////////////////////////////////////////
+void startReconfigure()
+{
+    stagingPool.resetCounts();
+    readFenceCounters(stagingFenceCounters, stagingFenceWaitsBegin);
+    reconfigureTimer.start();
+}
+
+double stopReconfigure(const char* change)
+{
+    reconfigureTimer.stop();
+    double time = reconfigureTimer.getElapsedTimeInMilliSec();
+
+    cout << std::fixed << std::setprecision(1);
+    cout << "Reconfiguration hitch (" << change << "): " << time << " ms -- Staging pool: ";
+    if (stagingPoolEnabled) {
+        FenceWaits waits = getFenceWaitsSince(stagingFenceCounters, stagingFenceWaitsBegin);
+        cout << stagingPool.getHitCount() << " reused (" << waits.waitMicroSeconds / 1000.0 << " ms GPU wait), "
+             << stagingPool.getMissCount() << " created, " << stagingPool.getSize() / (1024.0 * 1024) << " MB kept" << endl;
+    }
+    else {
+        cout << "off, " << stagingPool.getMissCount() << " created" << endl;
+    }
+    cout << std::resetiosflags(std::ios_base::fixed | std::ios_base::floatfield);
+    return time;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// switch to another PBO method with 'count' PBOs
+///////////////////////////////////////////////////////////////////////////////
+void setPboMethod(PboMethod method, int count)
+{
+    // Release the buffers with the method that created them
+    setPboCount(0);
+    pboMethod = method;
+    cout << "PBO Method: " << getPboMethodName(pboMethod) << endl;
+    if ((pboMethod == DSA) != textureImmutable) {
+        initTexture(); // Switch between mutable and immutable texture storage
+    }
+    setPboCount(count);
+}
+
 void setPboCount(int count)
 {
     if (!pboSupported)
         return;
 
+    stopProducer(); // The producer and upload worker threads write to the slots
+    stopUploadWorker();
+
+    if (pboMethod == PERSISTENT_RING) {
+        setPboRingCount(count);
+        markReallocation();
+        startProducer();
+        return;
+    }
+
+    int oldCount = pboCount;
     if (count > pboCount) {
         if (pboMethod != AMD) {
             // Generate each Pixel Buffer object and allocate memory for it
@@ -1062,16 +3677,75 @@ void setPboCount(int count)
 
             glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0); // Unbind any buffer object previously bound
             for (int i = pboCount; i < count; ++i) {
+                StagingBuffer buffer;
+                if (stagingPool.acquire(dataSize, getPboUsage(), buffer)) {
+                    waitStagingBuffer(buffer);
+                    pboIds.push_back(buffer.id); // Still mapped if the method maps it once
+                    pboFences.push_back(NULL);
+                    pboPointers.push_back(buffer.ptr);
+
+                    cout << "Reused PBO buffer #" << i << " of size: " << dataSize << endl;
+                    continue;
+                }
+
                 GLuint pboId;
+                GLubyte* ptr = NULL;
+                if (pboMethod == DSA) {
+                    // Direct State Access: the buffer is created, allocated and mapped without binding it
+                    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+                    glCreateBuffers(1, &pboId);
+                    glNamedBufferStorage(pboId, dataSize, NULL, flags); // Reserve the memory space for the PBO
+                    ptr = (GLubyte*)glMapNamedBufferRange(pboId, 0, dataSize, flags);
+                    if (NULL == ptr) {
+                        cout << "ERROR [setPboCount] (glMapNamedBufferRange): " << (char*)gluErrorString(glGetError()) << endl;
+                        glDeleteBuffers(1, &pboId);
+                        break;
+                    }
+                    prefaultBuffer(ptr, dataSize);
+
+                    pboIds.push_back(pboId); // Update our list of PBO IDs
+                    pboFences.push_back(NULL);
+                    pboPointers.push_back(ptr);
+
+                    cout << "Created PBO buffer #" << i << " of size: " << dataSize << endl;
+                    continue;
+                }
+
                 glGenBuffers(1, &pboId); // Generate new Buffer Object ID
                 glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pboId); // Create a zero-sized memory Pixel Buffer Object and bind it
-                glBufferData(GL_PIXEL_UNPACK_BUFFER, DATA_SIZE, NULL, GL_STREAM_DRAW); // Reserve the memory space for the PBO
+
+                if (pboMethod == PERSISTENT_COHERENT || pboMethod == PERSISTENT_FLUSH || pboMethod == BANDED
+                        || pboMethod == SHARED_CONTEXT) {
+                    // Immutable storage, mapped only once for the whole lifetime of the PBO
+                    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT;
+                    GLbitfield mapFlags = flags;
+                    if (pboMethod != PERSISTENT_FLUSH) {
+                        flags |= GL_MAP_COHERENT_BIT;
+                        mapFlags = flags;
+                    }
+                    else {
+                        mapFlags |= GL_MAP_FLUSH_EXPLICIT_BIT; // Written ranges are flushed by hand
+                    }
+                    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, dataSize, NULL, flags); // Reserve the memory space for the PBO
+                    ptr = (GLubyte*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, dataSize, mapFlags);
+                    if (NULL == ptr) {
+                        cout << "ERROR [setPboCount] (glMapBufferRange): " << (char*)gluErrorString(glGetError()) << endl;
+                        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                        glDeleteBuffers(1, &pboId);
+                        break;
+                    }
+                    prefaultBuffer(ptr, dataSize);
+                }
+                else {
+                    glBufferData(GL_PIXEL_UNPACK_BUFFER, dataSize, NULL, GL_STREAM_DRAW); // Reserve the memory space for the PBO
+                }
                 glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0); // Release the PBO binding
 
                 pboIds.push_back(pboId); // Update our list of PBO IDs
                 pboFences.push_back(NULL);
+                pboPointers.push_back(ptr);
 
-                cout << "Created PBO buffer #" << i << " of size: " << DATA_SIZE << endl;
+                cout << "Created PBO buffer #" << i << " of size: " << dataSize << endl;
             }
             pboCount = pboIds.size();
             assert(GL_NO_ERROR == glGetError());
@@ -1082,24 +3756,38 @@ void setPboCount(int count)
 
             glBindBuffer(GL_EXTERNAL_VIRTUAL_MEMORY_BUFFER_AMD, 0); // Unbind any buffer object previously bound
             for (int i = pboCount; i < count; ++i) {
+                StagingBuffer buffer;
+                if (stagingPool.acquire(dataSize, STAGING_PINNED, buffer)) {
+                    waitStagingBuffer(buffer);
+                    pboIds.push_back(buffer.id); // Still pinning its memory buffer
+                    pboFences.push_back(NULL);
+                    pboPointers.push_back(NULL);
+                    alignedBuffers.push_back(buffer.ptr);
+
+                    cout << "Reused PBO buffer #" << i << " with its memory buffer" << endl;
+                    continue;
+                }
+
                 GLuint pboId;
                 glGenBuffers(1, &pboId); // Generate new Buffer Object ID
                 glBindBuffer(GL_EXTERNAL_VIRTUAL_MEMORY_BUFFER_AMD, pboId); // Create a zero-sized memory Pixel Buffer Object and bind it
                 assert(GL_NO_ERROR == glGetError());
 
                 // Memory alignment functions are compiler-specific
-                GLubyte* ptAlignedBuffer = (GLubyte*)alignedMalloc(systemPageSize, DATA_SIZE);
+                HugePages pages;
+                GLubyte* ptAlignedBuffer = allocStagingBuffer(dataSize, &pages);
                 if (NULL == ptAlignedBuffer) {
-                    cout << "ERROR [setPboCount] (alignedMalloc) size: " << DATA_SIZE << " alignment: " << systemPageSize << endl;
+                    cout << "ERROR [setPboCount] (allocStagingBuffer) size: " << dataSize << " alignment: " << systemPageSize << endl;
                     break;
                 }
-                cout << "Created memory buffer #" << i << " of size: " << DATA_SIZE << " alignment: " << systemPageSize << endl;
+                cout << "Created memory buffer #" << i << " of size: " << dataSize << " alignment: " << systemPageSize
+                     << " (" << getHugePagesName(pages) << ")" << endl;
 
-                glBufferData(GL_EXTERNAL_VIRTUAL_MEMORY_BUFFER_AMD, DATA_SIZE, ptAlignedBuffer, GL_STREAM_DRAW); // Take control of the memory space for the PBO
+                glBufferData(GL_EXTERNAL_VIRTUAL_MEMORY_BUFFER_AMD, dataSize, ptAlignedBuffer, GL_STREAM_DRAW); // Take control of the memory space for the PBO
                 GLenum error = glGetError();
                 if (GL_NO_ERROR != error) {
                     cout << "ERROR [setPboCount] (glBufferData): " << (char*)gluErrorString(error) << endl;
-                    alignedFree(ptAlignedBuffer);
+                    freeStagingBuffer(ptAlignedBuffer);
                     cout << "Freed memory buffer #" << i << endl;
                     break;
                 }
@@ -1108,6 +3796,7 @@ void setPboCount(int count)
 
                 pboIds.push_back(pboId); // Update our list of PBO IDs
                 pboFences.push_back(NULL);
+                pboPointers.push_back(NULL);
                 alignedBuffers.push_back((GLubyte*)ptAlignedBuffer);
 
                 cout << "Created PBO buffer #" << i << endl;
@@ -1120,14 +3809,18 @@ void setPboCount(int count)
         if (pboMethod != AMD) {
             glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0); // Unbind any buffer object previously bound
             for (int i = pboCount - 1; i >= count; --i) {
-                glDeleteSync(pboFences.back());
+                if (pboFences.back())
+                    glDeleteSync(pboFences.back()); // Replaced by the fence of the buffer
                 pboFences.pop_back();
 
-                GLuint pboId = pboIds.back();
-                glDeleteBuffers(1, &pboId);
+                // Kept mapped in the pool, or deleted by destroyStagingBuffer()
+                StagingBuffer buffer = { pboIds.back(), pboPointers.back(), (size_t)dataSize, getPboUsage(), 0, NULL };
+                fenceStagingBuffer(buffer);
+                stagingPool.release(buffer);
+                pboPointers.pop_back();
                 pboIds.pop_back(); // Update our list of PBO IDs
 
-                cout << "Deleted PBO buffer #" << i << endl;
+                cout << "Released PBO buffer #" << i << endl;
             }
             pboCount = pboIds.size();
             assert(GL_NO_ERROR == glGetError());
@@ -1135,24 +3828,633 @@ void setPboCount(int count)
         else {
             glBindBuffer(GL_EXTERNAL_VIRTUAL_MEMORY_BUFFER_AMD, 0); // Unbind any buffer object previously bound
             for (int i = pboCount - 1; i >= count; --i) {
-                glDeleteSync(pboFences.back());
+                if (pboFences.back())
+                    glDeleteSync(pboFences.back()); // Replaced by the fence of the buffer
                 pboFences.pop_back();
+                pboPointers.pop_back();
 
-                GLuint pboId = pboIds.back();
-                glDeleteBuffers(1, &pboId);
+                // The buffer object keeps its memory buffer pinned in the pool
+                StagingBuffer buffer = { pboIds.back(), alignedBuffers.back(), (size_t)dataSize, STAGING_PINNED, 0, NULL };
+                fenceStagingBuffer(buffer);
+                stagingPool.release(buffer);
                 pboIds.pop_back(); // Update our list of PBO IDs
-
-                cout << "Deleted PBO buffer #" << i << endl;
-
-                alignedFree(alignedBuffers.back());
                 alignedBuffers.pop_back();
 
-                cout << "Freed memory buffer #" << i << endl;
+                cout << "Released PBO buffer #" << i << " with its memory buffer" << endl;
             }
             pboCount = pboIds.size();
             assert(GL_NO_ERROR == glGetError());
         }
     }
 
+    if (pboCount != oldCount) {
+        markReallocation();
+    }
+
+    // The contents of the new buffers are unknown, so copy them whole the first time
+    pboDirtyRects.assign(pboCount, getCopyRects(std::vector<DirtyRect>()));
+
     cout << "PBO Count: " << pboCount << endl;
+
+    startProducer();
+    startUploadWorker();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// (re)create the single buffer used by the PERSISTENT_RING method
+// Immutable storage cannot be resized, so the buffer is always created again
+// with room for 'count' slots.
+///////////////////////////////////////////////////////////////////////////////
+void setPboRingCount(int count)
+{
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0); // Unbind any buffer object previously bound
+
+    if (!pboIds.empty()) {
+        for (int i = 0; i < pboCount; ++i) {
+            if (pboFences[i])
+                glDeleteSync(pboFences[i]); // Replaced by the fence of the buffer
+        }
+        StagingBuffer buffer = { pboIds.back(), pboPointers[0], (size_t)(pboSlotSize * pboCount), STAGING_COHERENT, 0, NULL };
+        fenceStagingBuffer(buffer);
+        stagingPool.release(buffer);
+        cout << "Released PBO ring buffer of " << pboCount << " slot(s)" << endl;
+
+        pboIds.clear();
+        pboFences.clear();
+        pboPointers.clear();
+        pboCount = 0;
+    }
+
+    if (count > 0) {
+        // Pad each slot so every offset is aligned to a memory page,
+        // which also satisfies the minimum mapping alignment
+        GLint mapAlignment = 0;
+        glGetIntegerv(GL_MIN_MAP_BUFFER_ALIGNMENT, &mapAlignment);
+        GLsizeiptr alignment = (mapAlignment > systemPageSize) ? mapAlignment : systemPageSize;
+        pboSlotSize = (dataSize + alignment - 1) / alignment * alignment;
+
+        GLuint pboId = 0;
+        GLubyte* ptr = NULL;
+        StagingBuffer buffer;
+        bool reused = stagingPool.acquire(pboSlotSize * count, STAGING_COHERENT, buffer);
+        if (reused) {
+            waitStagingBuffer(buffer);
+            pboId = buffer.id;
+            ptr = buffer.ptr;
+        }
+        else {
+            glGenBuffers(1, &pboId); // Generate new Buffer Object ID
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pboId);
+
+            const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_PIXEL_UNPACK_BUFFER, pboSlotSize * count, NULL, flags); // Reserve the memory space for all slots
+            ptr = (GLubyte*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, pboSlotSize * count, flags);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0); // Release the PBO binding
+            if (NULL == ptr) {
+                cout << "ERROR [setPboRingCount] (glMapBufferRange): " << (char*)gluErrorString(glGetError()) << endl;
+                glDeleteBuffers(1, &pboId);
+            }
+            prefaultBuffer(ptr, pboSlotSize * count);
+        }
+        if (ptr) {
+            pboIds.push_back(pboId);
+            for (int i = 0; i < count; ++i) {
+                pboFences.push_back(NULL);
+                pboPointers.push_back(ptr + pboSlotSize * i);
+            }
+            pboCount = count;
+
+            cout << (reused ? "Reused" : "Created") << " PBO ring buffer of " << count << " slot(s), slot size: " << pboSlotSize
+                 << " total size: " << pboSlotSize * count << endl;
+        }
+    }
+    assert(GL_NO_ERROR == glGetError());
+
+    // The contents of the new buffers are unknown, so copy them whole the first time
+    pboDirtyRects.assign(pboCount, getCopyRects(std::vector<DirtyRect>()));
+
+    cout << "PBO Count: " << pboCount << endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// buffer object and byte offset that hold the data of slot 'idx'
+///////////////////////////////////////////////////////////////////////////////
+GLuint getPboId(int idx)
+{
+    return (pboMethod == PERSISTENT_RING) ? pboIds[0] : pboIds[idx];
+}
+
+GLintptr getPboOffset(int idx)
+{
+    return (pboMethod == PERSISTENT_RING) ? pboSlotSize * idx : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CPU pointer to slot 'idx' of a method that keeps its slots mapped or pinned
+///////////////////////////////////////////////////////////////////////////////
+GLubyte* getPboPointer(int idx)
+{
+    return (pboMethod == AMD) ? alignedBuffers[idx] : pboPointers[idx];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// start the producer thread if it is enabled and the method allows it
+// All the slots are idle at this point, so they are all handed over as free.
+///////////////////////////////////////////////////////////////////////////////
+void startProducer()
+{
+    if (!producerEnabled || producerRunning || pboCount == 0 || !isPboMethodMapped(pboMethod))
+        return;
+
+    filledSlots.clear();
+    freeSlots.clear();
+    pendingSlots.clear();
+    slotUpdateTimes.assign(pboCount, 0);
+    for (int i = 0; i < pboCount; ++i) {
+        waitPboFence(i);
+        freeSlots.push(i);
+    }
+
+    producerStop = false;
+    producerThread = std::thread(producerLoop);
+    producerRunning = true;
+    cout << "Producer thread started" << endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// stop the producer thread and wait until the GPU is done with all slots
+// Frames written but not copied yet are dropped.
+///////////////////////////////////////////////////////////////////////////////
+void stopProducer()
+{
+    if (!producerRunning)
+        return;
+
+    producerStop = true;
+    producerThread.join();
+    producerRunning = false;
+
+    for (int i = 0; i < pboCount; ++i) {
+        waitPboFence(i);
+    }
+    pendingSlots.clear();
+    waitTime = 0;
+    cout << "Producer thread stopped" << endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// body of the producer thread
+// It never calls the GL: it only writes through the persistent pointers and
+// exchanges slot indices with the GL thread.
+///////////////////////////////////////////////////////////////////////////////
+void producerLoop()
+{
+    Timer timer;
+    while (!producerStop) {
+        int slot;
+        if (!freeSlots.pop(slot)) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        timer.start();
+        updatePixels(getPboPointer(slot), dataSize);
+        timer.stop();
+        slotUpdateTimes[slot] = timer.getElapsedTimeInMilliSec();
+        pboDirtyRects[slot] = dirtyRects;
+
+        filledSlots.push(slot); // Never full: there are only pboCount slots
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// give the slots whose copy has completed back to the producer thread
+// Slots are fenced in order, so the first unsignaled fence stops the scan.
+// If 'wait' is true, block until at least the oldest slot is done.
+///////////////////////////////////////////////////////////////////////////////
+void recycleSlots(bool wait)
+{
+    while (!pendingSlots.empty()) {
+        int slot = pendingSlots.front();
+        GLenum result;
+        if (wait) {
+            Timer waitTimer;
+            waitTimer.start();
+            result = glClientWaitSync(pboFences[slot], 0, GL_TIMEOUT_IGNORED);
+            waitTimer.stop();
+            countFenceWait(result, waitTimer.getElapsedTimeInMicroSec(), pboFenceCounters);
+        }
+        else {
+            result = glClientWaitSync(pboFences[slot], 0, 0); // Polling is not a wait
+        }
+        if (result == GL_TIMEOUT_EXPIRED)
+            break;
+        wait = false;
+
+        glDeleteSync(pboFences[slot]);
+        pboFences[slot] = NULL;
+        pendingSlots.pop_front();
+        freeSlots.push(slot);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// start the upload worker thread of the SHARED_CONTEXT method
+// Every texture is handed over to the worker with the fence of its last draw.
+///////////////////////////////////////////////////////////////////////////////
+void startUploadWorker()
+{
+    if (pboMethod != SHARED_CONTEXT || uploadWorkerRunning || pboCount == 0 || textureIds.empty())
+        return;
+
+    readyTextures.clear();
+    drawnTextures.clear();
+    for (size_t i = 0; i < textureIds.size(); ++i) {
+        TextureHandoff item = { (int)i, textureFences[i], 0, 0 };
+        textureFences[i] = NULL;
+        drawnTextures.push(item);
+    }
+    glFinish(); // The PBOs and textures must be complete before the other context uses them
+
+    uploadWorkerStop = false;
+    uploadWorkerAlive = true;
+    uploadWorkerThread = std::thread(uploadWorkerLoop);
+    uploadWorkerRunning = true;
+    cout << "Upload worker thread started" << endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// stop the upload worker thread and release the fences still in flight
+///////////////////////////////////////////////////////////////////////////////
+void stopUploadWorker()
+{
+    if (!uploadWorkerRunning)
+        return;
+
+    uploadWorkerStop = true;
+    uploadWorkerThread.join();
+    uploadWorkerRunning = false;
+
+    TextureHandoff item;
+    while (readyTextures.pop(item))
+        glDeleteSync(item.fence);
+    while (drawnTextures.pop(item))
+        glDeleteSync(item.fence);
+    waitTime = 0;
+    cout << "Upload worker thread stopped" << endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// body of the upload worker thread
+// It writes each frame to a persistently mapped PBO, then copies it to the
+// texture received from the render thread, once the GPU is done drawing it.
+///////////////////////////////////////////////////////////////////////////////
+void uploadWorkerLoop()
+{
+    if (!uploadContext.makeCurrent()) {
+        cout << "ERROR [uploadWorkerLoop] (makeCurrent): cannot bind the shared context" << endl;
+        uploadWorkerAlive = false;
+        return;
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4); // 4-byte pixel alignment, as in initGL()
+
+    Timer timer;
+    int slot = 0;
+    while (!uploadWorkerStop) {
+        TextureHandoff item;
+        if (!drawnTextures.pop(item)) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        timer.start();
+        slot = (slot + 1) % pboCount;
+        waitPboFence(slot);
+        updatePixels(pboPointers[slot], dataSize); // Update data directly on the mapped buffer
+        timer.stop();
+        item.updateTime = timer.getElapsedTimeInMilliSec();
+
+        timer.start();
+        if (item.fence) {
+            glWaitSync(item.fence, 0, GL_TIMEOUT_IGNORED); // The texture may still be drawn
+            glDeleteSync(item.fence);
+        }
+        glBindTexture(GL_TEXTURE_2D, textureIds[item.textureIdx]);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pboIds[slot]);
+        copyPixelRects(getCopyRects(dirtyRects), NULL, 0, imageHeight);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        glDeleteSync(pboFences[slot]);
+        pboFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        item.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush(); // The fences must reach the GPU before the render thread's context waits for them
+        timer.stop();
+        item.copyTime = timer.getElapsedTimeInMilliSec();
+
+        readyTextures.push(item); // Never full: there are only textureCount textures
+    }
+
+    glFinish(); // Leave no command reading the PBOs or writing the textures
+    uploadContext.doneCurrent();
+    uploadWorkerAlive = false;
+}
+
+void waitPboFence(int idx)
+{
+    waitFence(pboFences[idx], pboFenceCounters);
+}
+
+void waitTextureFence(int idx)
+{
+    waitFence(textureFences[idx], textureFenceCounters);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// block until 'fence' is signaled, then delete it
+///////////////////////////////////////////////////////////////////////////////
+void waitFence(GLsync& fence, FenceCounters& counters)
+{
+    if (!glIsSync(fence))
+        return;
+
+    Timer waitTimer;
+    waitTimer.start();
+    GLenum result = glClientWaitSync(fence, 0, GL_TIMEOUT_IGNORED);
+    waitTimer.stop();
+    countFenceWait(result, waitTimer.getElapsedTimeInMicroSec(), counters);
+
+    switch (result) {
+    case GL_ALREADY_SIGNALED:
+        // Transfer was already done when trying to use buffer
+        //cout << "DEBUG (glClientWaitSync): ALREADY_SIGNALED (good timing!)" << endl;
+        break;
+    case GL_CONDITION_SATISFIED:
+        // This means that we had to wait for the fence to synchronize us after using all the buffers,
+        // which implies that the GPU command queue is full and that we are GPU-bound (DMA transfers aren't fast enough).
+        //cout << "WARNING (glClientWaitSync): CONDITION_SATISFIED (had to wait for the sync)" << endl;
+        break;
+    case GL_TIMEOUT_EXPIRED:
+        cout << "WARNING (glClientWaitSync): TIMEOUT_EXPIRED (DMA transfers are too slow!)" << endl;
+        break;
+    case GL_WAIT_FAILED:
+        cout << "ERROR (glClientWaitSync): WAIT_FAILED: " << (char*)gluErrorString(glGetError()) << endl;
+        break;
+    }
+    glDeleteSync(fence); fence = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// grow or shrink the PBO ring from the PBO fence waits of the last second
+// The waits for the textures are left out, more PBOs would not avoid them.
+// The new count is only decided here, in the middle of a frame; it is applied
+// by applyAdaptivePboCount() once the frame is done.
+///////////////////////////////////////////////////////////////////////////////
+void adaptPboCount(long long fenceWaits, long long fenceStalls, double blockedTime)
+{
+    if (!adaptivePboCount || pboCount == 0 || !isPboMethodFenced(pboMethod) || fenceWaits == 0)
+        return;
+
+    double stallRate = (double)fenceStalls / fenceWaits;
+    if (stallRate > ADAPTIVE_GROW_STALL_RATE || blockedTime > ADAPTIVE_GROW_BLOCKED_TIME) {
+        ++adaptiveGrowSeconds;
+        adaptiveShrinkSeconds = 0;
+    }
+    else if (fenceStalls == 0 && blockedTime < ADAPTIVE_SHRINK_BLOCKED_TIME) {
+        ++adaptiveShrinkSeconds;
+        adaptiveGrowSeconds = 0;
+    }
+    else {
+        adaptiveGrowSeconds = adaptiveShrinkSeconds = 0; // In between: keep the count
+    }
+
+    int count = pboCount;
+    if (adaptiveGrowSeconds >= ADAPTIVE_GROW_SECONDS) {
+        if (pboCount > adaptiveStalledCount)
+            adaptiveStalledCount = pboCount;
+        if (pboCount < ADAPTIVE_MAX_PBO_COUNT)
+            count = pboCount + 1;
+    }
+    else if (pboCount > ADAPTIVE_MIN_PBO_COUNT) {
+        int seconds = (pboCount - 1 <= adaptiveStalledCount) ? ADAPTIVE_RETRY_SECONDS : ADAPTIVE_SHRINK_SECONDS;
+        if (adaptiveShrinkSeconds >= seconds)
+            count = pboCount - 1;
+    }
+    if (count == pboCount)
+        return;
+
+    cout << std::fixed << std::setprecision(1);
+    cout << "Adaptive PBO count: " << pboCount << " -> " << count << " ("
+         << 100 * stallRate << "% stalled, " << blockedTime << " ms/s blocked)" << endl;
+    cout << std::resetiosflags(std::ios_base::fixed | std::ios_base::floatfield);
+
+    adaptiveGrowSeconds = adaptiveShrinkSeconds = 0;
+    adaptivePendingCount = count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// switch to the PBO count decided by adaptPboCount(), timed as a reconfiguration
+// The next frames are timed as the first ones after a reallocation, as with
+// the PBO count keys.
+///////////////////////////////////////////////////////////////////////////////
+void applyAdaptivePboCount()
+{
+    if (adaptivePendingCount == 0)
+        return;
+
+    int count = adaptivePendingCount;
+    adaptivePendingCount = 0;
+    if (count == pboCount)
+        return;
+
+    startReconfigure();
+    setPboCount(count);
+    stopReconfigure("adaptive PBO count");
+    markReallocation();
+    resetTransferRate();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// forget the history of the adaptive PBO count, e.g. for another workload
+///////////////////////////////////////////////////////////////////////////////
+void resetAdaptivePboCount()
+{
+    adaptiveGrowSeconds = adaptiveShrinkSeconds = 0;
+    adaptiveStalledCount = 0;
+    adaptivePendingCount = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// add a blocking fence wait to the totals, 'waitTime' in microseconds
+///////////////////////////////////////////////////////////////////////////////
+void countFenceWait(GLenum result, double waitTime, FenceCounters& counters)
+{
+    ++counters.waitCount;
+    counters.waitMicroSeconds += (long long)waitTime;
+    switch (result) {
+    case GL_ALREADY_SIGNALED:
+        ++counters.signaledCount;
+        break;
+    case GL_CONDITION_SATISFIED:
+    case GL_TIMEOUT_EXPIRED:
+        ++counters.stallCount;
+        break;
+    default:
+        ++counters.failedCount;
+        break;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// copy the current values of the fence counters
+///////////////////////////////////////////////////////////////////////////////
+void readFenceCounters(const FenceCounters& counters, FenceWaits& waits)
+{
+    waits.waitCount = counters.waitCount;
+    waits.signaledCount = counters.signaledCount;
+    waits.stallCount = counters.stallCount;
+    waits.failedCount = counters.failedCount;
+    waits.waitMicroSeconds = counters.waitMicroSeconds;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// fence waits counted since readFenceCounters() returned 'begin'
+///////////////////////////////////////////////////////////////////////////////
+FenceWaits getFenceWaitsSince(const FenceCounters& counters, const FenceWaits& begin)
+{
+    FenceWaits waits;
+    readFenceCounters(counters, waits);
+    waits.waitCount -= begin.waitCount;
+    waits.signaledCount -= begin.signaledCount;
+    waits.stallCount -= begin.stallCount;
+    waits.failedCount -= begin.failedCount;
+    waits.waitMicroSeconds -= begin.waitMicroSeconds;
+    return waits;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// print the fence waits of a period of 'elapsedTime' seconds, if any
+// e.g. " -- PBO fences: 60 waits, 45 signaled, 25.0% stalled, 3.2 ms/s blocked"
+// The failed waits (GL_WAIT_FAILED) are only printed when there are some.
+///////////////////////////////////////////////////////////////////////////////
+void printFenceWaits(const char* name, const FenceWaits& waits, double elapsedTime)
+{
+    if (waits.waitCount <= 0)
+        return;
+
+    cout << std::setprecision(1);
+    cout << " -- " << name << ": " << waits.waitCount << " waits, "
+         << waits.signaledCount << " signaled, "
+         << 100.0 * waits.stallCount / waits.waitCount << "% stalled, ";
+    if (waits.failedCount > 0)
+        cout << waits.failedCount << " failed, ";
+    cout << waits.waitMicroSeconds * 1e-3 / elapsedTime << " ms/s blocked";
+}
+
+bool isPboMethodSupported(PboMethod method)
+{
+    switch (method) {
+    case AMD:
+        return amdSupported;
+    case PERSISTENT_COHERENT:
+    case PERSISTENT_FLUSH:
+    case PERSISTENT_RING:
+    case BANDED:
+        return storageSupported;
+    case INVALIDATE_DATA:
+        return invalidateSupported;
+    case DSA:
+        return dsaSupported && storageSupported;
+    case SHARED_CONTEXT:
+        return sharedContextSupported && storageSupported;
+    default:
+        return true;
+    }
+}
+
+bool isPboMethodFenced(PboMethod method)
+{
+    switch (method) {
+    case UNSYNCH_FENCES:
+    case AMD:
+    case PERSISTENT_COHERENT:
+    case PERSISTENT_FLUSH:
+    case PERSISTENT_RING:
+    case DSA:
+    case BANDED:
+    case SHARED_CONTEXT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// true if the CPU writes the slots of 'method' through pointers that stay
+// valid between frames and need no GL call to become visible
+///////////////////////////////////////////////////////////////////////////////
+bool isPboMethodMapped(PboMethod method)
+{
+    switch (method) {
+    case AMD:
+    case PERSISTENT_COHERENT:
+    case PERSISTENT_RING:
+    case DSA:
+        return true;
+    default:
+        return false;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// true if 'method' discards the contents of the buffer before each update
+// (orphaning or invalidation), so the pixels not written are undefined
+///////////////////////////////////////////////////////////////////////////////
+bool isPboMethodDiscarding(PboMethod method)
+{
+    switch (method) {
+    case ORPHAN:
+    case UNSYNCH_ORPHAN:
+    case MAP_INVALIDATE:
+    case INVALIDATE_DATA:
+        return true;
+    default:
+        return false;
+    }
+}
+
+const char* getPboMethodName(PboMethod method)
+{
+    switch (method) {
+    case NONE:
+        return "None (direct transfer)";
+    case ORPHAN:
+        return "Orphaning";
+    case UNSYNCH_ORPHAN:
+        return "Unsynchronized with orphaning";
+    case UNSYNCH_FENCES:
+        return "Unsynchronized with fences synchronization";
+    case AMD:
+        return "AMD_pinned_memory";
+    case PERSISTENT_COHERENT:
+        return "Persistent coherent mapping";
+    case PERSISTENT_FLUSH:
+        return "Persistent mapping with explicit flush";
+    case PERSISTENT_RING:
+        return "Persistent coherent ring in a single buffer";
+    case BUFFER_SUBDATA:
+        return "glBufferSubData from System Memory";
+    case MAP_INVALIDATE:
+        return "Orphaning with GL_MAP_INVALIDATE_BUFFER_BIT";
+    case INVALIDATE_DATA:
+        return "Unsynchronized with glInvalidateBufferData";
+    case DSA:
+        return "Direct State Access with immutable storage";
+    case BANDED:
+        return "Persistent coherent mapping, copied in bands";
+    case SHARED_CONTEXT:
+        return "Copied by a worker thread with a shared context";
+    default:
+        return "";
+    }
 }
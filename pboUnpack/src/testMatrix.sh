@@ -0,0 +1,51 @@
+#!/bin/sh
+###############################################################################
+# testMatrix.sh
+# =============
+# Runs a small benchmark matrix without --output and checks that its standard
+# output holds the records only, so that it can be parsed:
+# - CSV: the header, then one row per configuration with as many fields
+# - JSON Lines: one object per configuration
+# Every other message must have gone to the standard error.
+# It needs an EGL driver, e.g. Mesa llvmpipe.
+#
+# Usage: ./testMatrix.sh [program]    (default: ../bin/pboUnpack)
+###############################################################################
+
+PROGRAM=${1:-../bin/pboUnpack}
+ARGS="--matrix --methods 0,1,3 --pbos 1,2 --size 256x256 --warmup 0.1 --measure 0.2"
+RECORDS=5   # method 0 has no PBO count, methods 1 and 3 have 2
+
+OUTPUT=`mktemp`
+trap 'rm -f "$OUTPUT"' EXIT
+FAILED=0
+
+# CSV: the quoted fields (method names) may hold commas, they are removed first
+if ! "$PROGRAM" $ARGS --records csv > "$OUTPUT" 2> /dev/null; then
+    echo "FAILED: $PROGRAM $ARGS --records csv"
+    exit 1
+fi
+if ! awk -F, -v records=$RECORDS '
+    { gsub(/"[^"]*"/, "x") }
+    NR == 1 { if ($1 != "method") { print "line 1 is not the CSV header: " $0; exit 1 } fields = NF; next }
+    NF != fields { print "line " NR " has " NF " fields instead of " fields ": " $0; exit 1 }
+    END { if (NR - 1 != records) { print NR - 1 " CSV records instead of " records; exit 1 } }' "$OUTPUT"; then
+    FAILED=1
+fi
+
+# JSON Lines
+if ! "$PROGRAM" $ARGS --records json > "$OUTPUT" 2> /dev/null; then
+    echo "FAILED: $PROGRAM $ARGS --records json"
+    exit 1
+fi
+if ! awk -v records=$RECORDS '
+    !/^\{"method": .*\}$/ { print "line " NR " is not a JSON record: " $0; exit 1 }
+    END { if (NR != records) { print NR " JSON records instead of " records; exit 1 } }' "$OUTPUT"; then
+    FAILED=1
+fi
+
+if [ $FAILED -ne 0 ]; then
+    echo "FAILED: the matrix output cannot be parsed"
+    exit 1
+fi
+echo "Passed: the matrix output holds the records only"